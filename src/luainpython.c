@@ -22,13 +22,26 @@
 */
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
 
 #include <setjmp.h>
+#include <ctype.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#include "lunaticpython.h"
 #include "pythoninlua.h"
 #include "luainpython.h"
 
@@ -92,30 +105,269 @@ LuaStateObject *GetGlobalLuaState(void)
  ********************************************************************************/
 
 static PyObject *LuaObject_New(LuaStateObject *state, int n);
+static PyObject *LuaFrozen_New(LuaStateObject *state, int n);
+
+/* Short Lua strings (table keys, mostly) are converted through a
+ * direct-mapped cache of interned Python strings. Lua 5.1 strings are
+ * interned themselves, so the address of a live string identifies its
+ * contents; cached strings are anchored in a registry table, keyed by
+ * that address, so they can't be collected and the address reused
+ * while their entry exists. */
+#define LUA_STRCACHE_SIZE 1024
+#define LUA_STRCACHE_MAXLEN 64
+#define LUA_STRCACHE_ANCHORS "PyStringCache"
+
+static PyObject *LuaConvertString(LuaStateObject *state, int n)
+{
+	lua_State *L = state->LuaState;
+	LuaStringCacheEntry *e;
+	PyObject *o;
+	size_t len;
+	const char *s = lua_tolstring(L, n, &len);
+
+	if (len > LUA_STRCACHE_MAXLEN)
+		return PyString_FromStringAndSize(s, len);
+
+	if (!state->strcache) {
+		state->strcache = PyMem_New(LuaStringCacheEntry, LUA_STRCACHE_SIZE);
+		if (!state->strcache)
+			return PyString_FromStringAndSize(s, len);
+		memset(state->strcache, 0,
+		       sizeof(LuaStringCacheEntry) * LUA_STRCACHE_SIZE);
+	}
+
+	e = &state->strcache[((size_t)s >> 4) & (LUA_STRCACHE_SIZE-1)];
+	if (e->s == s) {
+		Py_INCREF(e->o);
+		return e->o;
+	}
+
+	o = PyString_FromStringAndSize(s, len);
+	if (!o)
+		return NULL;
+	PyString_InternInPlace(&o);
+
+	if (n < 0 && n > LUA_REGISTRYINDEX)
+		n = lua_gettop(L) + n + 1;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_STRCACHE_ANCHORS);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUA_STRCACHE_ANCHORS);
+	}
+	if (e->s) {
+		lua_pushlightuserdata(L, (void *)e->s);
+		lua_pushnil(L);
+		lua_rawset(L, -3);
+		Py_DECREF(e->o);
+	}
+	lua_pushlightuserdata(L, (void *)s);
+	lua_pushvalue(L, n);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+
+	e->s = s;
+	e->o = o;
+	Py_INCREF(o);
+	return o;
+}
+
+static void LuaStringCache_clear(LuaStateObject *state)
+{
+	int i;
+	if (!state->strcache)
+		return;
+	for (i = 0; i != LUA_STRCACHE_SIZE; i++)
+		Py_XDECREF(state->strcache[i].o);
+	PyMem_Free(state->strcache);
+	state->strcache = NULL;
+}
+
+static PyObject *LuaConvertPyObject(lua_State *L, int n)
+{
+	PyObject *o = check_py_object(L, n)->o;
+	Py_INCREF(o);
+	return o;
+}
+
+/* Lazy module proxies are imported when they cross. */
+static PyObject *LuaConvertLazy(lua_State *L, int n)
+{
+	py_object *obj = py_lazy_resolve(L, n);
+	if (!obj)
+		return NULL;
+	Py_INCREF(obj->o);
+	return obj->o;
+}
+
+static PyObject *LuaConvertSink(lua_State *L, int n)
+{
+	PyObject *o = check_py_sink(L, n);
+	Py_INCREF(o);
+	return o;
+}
+
+/* Structures convert back to the object they access. */
+static PyObject *LuaConvertStruct(lua_State *L, int n)
+{
+	py_struct *s = (py_struct *)lua_touserdata(L, n);
+	Py_INCREF(s->view.obj);
+	return s->view.obj;
+}
+
+static PyObject *LuaConvertNumArray(lua_State *L, int n)
+{
+	PyObject *o = check_py_numarray(L, n);
+	Py_INCREF(o);
+	return o;
+}
+
+/* Views convert back to the object they look at. */
+static PyObject *LuaConvertView(lua_State *L, int n)
+{
+	py_view *view = (py_view *)lua_touserdata(L, n);
+	if (!view->view.obj)
+		return NULL;
+	Py_INCREF(view->view.obj);
+	return view->view.obj;
+}
+
+/* Frozen tables convert to their memoized mapping. */
+static PyObject *LuaConvertFrozen(lua_State *L, int n)
+{
+	LuaStateObject *state;
+
+	lua_getglobal(L, "_PyLuaState");
+	state = (LuaStateObject *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return LuaFrozen_New(state, n);
+}
+
+/* Lua to Python converters, by metatable name */
+#define LUA_CONVERTERS_MAX 64
+
+typedef struct {
+	const char *tname;
+	LuaToPyFunc fn;
+} LuaConverter;
+
+static LuaConverter LuaConverters_table[LUA_CONVERTERS_MAX] = {
+	{POBJECT, LuaConvertPyObject},
+	{PLAZY, LuaConvertLazy},
+	{PSINK, LuaConvertSink},
+	{PVIEW, LuaConvertView},
+	{PSTRVIEW, LuaConvertView},
+	{PFROZEN, LuaConvertFrozen},
+	{PNUMARRAY, LuaConvertNumArray},
+	{PSTRUCT, LuaConvertStruct},
+};
+static int LuaConverters_count = 8;
+
+/* Bumped on registration, so states drop their lookup caches */
+static int LuaConverters_generation = 1;
+
+/**
+ * Register 'fn' to convert Lua values whose metatable is registered
+ * as 'tname' to Python. A NULL 'fn' restores the default conversion.
+ */
+int LuaConverter_register(const char *tname, LuaToPyFunc fn)
+{
+	int i;
+
+	for (i = 0; i != LuaConverters_count; i++)
+		if (strcmp(LuaConverters_table[i].tname, tname) == 0)
+			break;
+	if (i == LUA_CONVERTERS_MAX) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"too many converters registered");
+		return -1;
+	}
+	if (i == LuaConverters_count)
+		LuaConverters_count++;
+	LuaConverters_table[i].tname = tname;
+	LuaConverters_table[i].fn = fn;
+	LuaConverters_generation++;
+	return 0;
+}
+
+/**
+ * Find the converter for the metatable of the value at absolute index
+ * 'n'. Each state caches the converter index per metatable in a weak
+ * table in the registry, with the generation it was built for at [1].
+ */
+static LuaToPyFunc LuaConverter_find(lua_State *L, int n)
+{
+	int i;
+
+	if (!lua_getmetatable(L, n))
+		return NULL;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_CONVERTERS);
+	if (lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 1);
+		i = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	} else {
+		i = 0;
+	}
+	if (i != LuaConverters_generation) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushinteger(L, LuaConverters_generation);
+		lua_rawseti(L, -2, 1);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUA_CONVERTERS);
+	}
+
+	lua_pushvalue(L, -2);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		for (i = 0; i != LuaConverters_count; i++) {
+			int eq;
+			luaL_getmetatable(L, LuaConverters_table[i].tname);
+			eq = lua_rawequal(L, -1, -3);
+			lua_pop(L, 1);
+			if (eq)
+				break;
+		}
+		lua_pushvalue(L, -2);
+		lua_pushinteger(L, i);
+		lua_rawset(L, -3);
+	} else {
+		i = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+
+	return i < LuaConverters_count ? LuaConverters_table[i].fn : NULL;
+}
 
 PyObject *LuaConvert(LuaStateObject *state, int n)
 {
+	lua_State *L = state->LuaState;
 	PyObject *ret = NULL;
 
-	switch (lua_type(state->LuaState, n)) {
+	switch (lua_type(L, n)) {
 
 		case LUA_TNIL:
 			Py_INCREF(Py_None);
 			ret = Py_None;
 			break;
 
-		case LUA_TSTRING: {
-			size_t len;
-			const char *s = lua_tolstring(state->LuaState, n, &len);
-			ret = PyString_FromStringAndSize(s, len);
+		case LUA_TSTRING:
+			ret = LuaConvertString(state, n);
 			break;
-		}
 
 		case LUA_TNUMBER: {
-			lua_Number num = lua_tonumber(state->LuaState, n);
+			lua_Number num = lua_tonumber(L, n);
 #ifdef LUA_NUMBER_DOUBLE
 			if (num != (long)num) {
-				ret = PyFloat_FromDouble(n);
+				ret = PyFloat_FromDouble(num);
 			} else
 #endif
 			{
@@ -125,7 +377,7 @@ PyObject *LuaConvert(LuaStateObject *state, int n)
 		}
 
 		case LUA_TBOOLEAN:
-			if (lua_toboolean(state->LuaState, n)) {
+			if (lua_toboolean(L, n)) {
 				Py_INCREF(Py_True);
 				ret = Py_True;
 			} else {
@@ -134,13 +386,17 @@ PyObject *LuaConvert(LuaStateObject *state, int n)
 			}
 			break;
 
-		case LUA_TUSERDATA: {
-			py_object *obj = check_py_object(state->LuaState, n);
-
-			if (obj) {
-				Py_INCREF(obj->o);
-				ret = obj->o;
-				break;
+		case LUA_TUSERDATA:
+		case LUA_TTABLE: {
+			LuaToPyFunc fn;
+
+			if (n < 0 && n > LUA_REGISTRYINDEX)
+				n = lua_gettop(L) + n + 1;
+			fn = LuaConverter_find(L, n);
+			if (fn) {
+				ret = fn(L, n);
+				if (ret || PyErr_Occurred())
+					break;
 			}
 
 			/* Otherwise go on and handle as custom. */
@@ -154,11 +410,76 @@ PyObject *LuaConvert(LuaStateObject *state, int n)
 	return ret;
 }
 
-static int e_py_convert(lua_State *LuaState, PyObject *o, int withnone)
+/* In the other direction, interned Python strings (attribute names and
+ * other identifiers) are pushed from registry refs held in a
+ * direct-mapped cache, which saves Lua from hashing and looking up the
+ * string again on every push. Entries own a reference to the Python
+ * string, so its address can't be reused while cached. */
+#define LUA_REFCACHE_SIZE 256
+
+#define LuaStringRef_cacheable(o) \
+	(PyString_CheckExact(o) && PyString_CHECK_INTERNED(o) && \
+	 PyString_GET_SIZE(o) <= LUA_STRCACHE_MAXLEN)
+
+#define LuaStringRef_entry(state, o) \
+	(&(state)->refcache[((size_t)(o) >> 4) & (LUA_REFCACHE_SIZE-1)])
+
+/* Reference the string on top of the stack as the Lua value of 'o'. */
+static void LuaStringRef_store(LuaStateObject *state, PyObject *o)
+{
+	LuaStringRefEntry *e;
+	int ref;
+
+	if (!state->refcache) {
+		state->refcache = PyMem_New(LuaStringRefEntry, LUA_REFCACHE_SIZE);
+		if (!state->refcache)
+			return;
+		memset(state->refcache, 0,
+		       sizeof(LuaStringRefEntry) * LUA_REFCACHE_SIZE);
+	}
+	/* Take the new reference first: luaL_ref may raise a memory error,
+	 * which must leave the old entry intact */
+	lua_pushvalue(state->LuaState, -1);
+	ref = luaL_ref(state->LuaState, LUA_REGISTRYINDEX);
+	e = LuaStringRef_entry(state, o);
+	if (e->o) {
+		luaL_unref(state->LuaState, LUA_REGISTRYINDEX, e->ref);
+		Py_DECREF(e->o);
+	}
+	e->ref = ref;
+	e->o = o;
+	Py_INCREF(o);
+}
+
+static void LuaStringRef_clear(LuaStateObject *state)
+{
+	int i;
+	if (!state->refcache)
+		return;
+	for (i = 0; i != LUA_REFCACHE_SIZE; i++)
+		Py_XDECREF(state->refcache[i].o);
+	PyMem_Free(state->refcache);
+	state->refcache = NULL;
+}
+
+static int e_py_convert(LuaStateObject *state, PyObject *o, int withnone)
 {
+	lua_State *LuaState = state->LuaState;
+	int cacheable = LuaStringRef_cacheable(o);
 	int r = 0;
+
+	if (cacheable && state->refcache) {
+		LuaStringRefEntry *e = LuaStringRef_entry(state, o);
+		if (e->o == o) {
+			lua_rawgeti(LuaState, LUA_REGISTRYINDEX, e->ref);
+			return 1;
+		}
+	}
+
 	TRY {
 		r = py_convert(LuaState, o, withnone);
+		if (r && cacheable)
+			LuaStringRef_store(state, o);
 	} CATCH {
 		r = 0;
 	} ENDTRY;
@@ -168,10 +489,41 @@ static int e_py_convert(lua_State *LuaState, PyObject *o, int withnone)
 	return r;
 }
 
+PyObject *LuaError;
+
+/**
+ * Set the Python exception for the Lua error value on top of the stack.
+ * Python exceptions raised into Lua are restored unchanged, strings and
+ * numbers become 'exc' with 'msg' as prefix, and any other value is
+ * raised as lua.LuaError carrying the converted value.
+ */
+static void LuaState_seterror(LuaStateObject *state, PyObject *exc, const char *msg)
+{
+	lua_State *L = state->LuaState;
+	PyObject *value, *args;
+
+	if (py_exception_restore(L, -1))
+		return;
+	if (lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER) {
+		PyErr_Format(exc, "%s: %s", msg, lua_tostring(L, -1));
+		return;
+	}
+	value = LuaConvert(state, -1);
+	if (!value)
+		return;
+	args = PyTuple_Pack(1, value);
+	if (args) {
+		PyErr_SetObject(LuaError, args);
+		Py_DECREF(args);
+	}
+	Py_DECREF(value);
+}
+
 static PyObject *LuaCall(LuaStateObject *state, PyObject *args)
 {
 	PyObject *ret = NULL;
 	PyObject *arg;
+	int base = lua_gettop(state->LuaState);
 	int nargs, rc, i;
 
 	assert(PyTuple_Check(args));
@@ -183,31 +535,31 @@ static PyObject *LuaCall(LuaStateObject *state, PyObject *args)
 		if (arg == NULL) {
 			PyErr_Format(PyExc_TypeError,
 				     "failed to get tuple item #%d", i);
-			lua_settop(state->LuaState, 0);
+			lua_settop(state->LuaState, base - 1);
 			return NULL;
 		}
-		rc = e_py_convert(state->LuaState, arg, 0);
+		rc = e_py_convert(state, arg, 0);
 		if (!rc) {
 			PyErr_Format(PyExc_TypeError,
 				     "failed to convert argument #%d", i);
-			lua_settop(state->LuaState, 0);
+			lua_settop(state->LuaState, base - 1);
 			return NULL;
 		}
 	}
 
 	if (lua_pcall(state->LuaState, nargs, LUA_MULTRET, 0) != 0) {
-		PyErr_Format(PyExc_Exception,
-			     "error: %s", lua_tostring(state->LuaState, -1));
+		LuaState_seterror(state, PyExc_Exception, "error");
+		lua_settop(state->LuaState, base - 1);
 		return NULL;
 	}
 
-	nargs = lua_gettop(state->LuaState);
+	nargs = lua_gettop(state->LuaState) - base + 1;
 	if (nargs == 1) {
-		ret = LuaConvert(state, 1);
+		ret = LuaConvert(state, base);
 		if (!ret) {
 			PyErr_SetString(PyExc_TypeError,
 				        "failed to convert return");
-			lua_settop(state->LuaState, 0);
+			lua_settop(state->LuaState, base - 1);
 			return NULL;
 		}
 	} else if (nargs > 1) {
@@ -215,15 +567,15 @@ static PyObject *LuaCall(LuaStateObject *state, PyObject *args)
 		if (!ret) {
 			PyErr_SetString(PyExc_RuntimeError,
 					"failed to create return tuple");
-			lua_settop(state->LuaState, 0);
+			lua_settop(state->LuaState, base - 1);
 			return NULL;
 		}
 		for (i = 0; i != nargs; i++) {
-			arg = LuaConvert(state, i+1);
+			arg = LuaConvert(state, base + i);
 			if (!arg) {
 				PyErr_Format(PyExc_TypeError,
 					     "failed to convert return #%d", i);
-				lua_settop(state->LuaState, 0);
+				lua_settop(state->LuaState, base - 1);
 				Py_DECREF(ret);
 				return NULL;
 			}
@@ -234,7 +586,7 @@ static PyObject *LuaCall(LuaStateObject *state, PyObject *args)
 		ret = Py_None;
 	}
 	
-	lua_settop(state->LuaState, 0);
+	lua_settop(state->LuaState, base - 1);
 
 	return ret;
 }
@@ -266,6 +618,7 @@ static void LuaObject_dealloc(LuaObject *self)
 static PyObject *LuaObject_getattr(PyObject *obj, PyObject *attr)
 {
 	LuaStateObject *state = (LuaStateObject *)((LuaObject *)obj)->state;
+	int top = lua_gettop(state->LuaState);
 	lua_State *LuaState = state->LuaState;
 	PyObject *ret = NULL;
 	int rc;
@@ -274,7 +627,7 @@ static PyObject *LuaObject_getattr(PyObject *obj, PyObject *attr)
 		PyErr_SetString(PyExc_RuntimeError, "lost reference");
 		goto error;
 	}
-	rc = e_py_convert(state->LuaState, attr, 0);
+	rc = e_py_convert(state, attr, 0);
 	if (rc) {
 		TRY {
 			lua_gettable(state->LuaState, -2);
@@ -287,13 +640,14 @@ static PyObject *LuaObject_getattr(PyObject *obj, PyObject *attr)
 		PyErr_SetString(PyExc_ValueError, "can't convert attr/key");
 	}
   error:
-	lua_settop(state->LuaState, 0);
+	lua_settop(state->LuaState, top);
 	return ret;
 }
 
 static int LuaObject_setattr(PyObject *obj, PyObject *attr, PyObject *value)
 {
 	LuaStateObject *state = (LuaStateObject *)((LuaObject *)obj)->state;
+	int top = lua_gettop(state->LuaState);
 	lua_State *LuaState = state->LuaState;
 	int ret = -1;
 	int rc;
@@ -306,9 +660,9 @@ static int LuaObject_setattr(PyObject *obj, PyObject *attr, PyObject *value)
 		PyErr_SetString(PyExc_TypeError, "Lua object is not a table");
 		goto error;
 	}
-	rc = e_py_convert(state->LuaState, attr, 0);
+	rc = e_py_convert(state, attr, 0);
 	if (rc) {
-		rc = e_py_convert(state->LuaState, value, 0);
+		rc = e_py_convert(state, value, 0);
 		if (rc) {
 			TRY {
 				lua_settable(state->LuaState, -3);
@@ -325,7 +679,7 @@ static int LuaObject_setattr(PyObject *obj, PyObject *attr, PyObject *value)
 		PyErr_SetString(PyExc_ValueError, "can't convert key/attr");
 	}
   error:
-	lua_settop(state->LuaState, 0);
+	lua_settop(state->LuaState, top);
 	return ret;
 }
 
@@ -384,7 +738,6 @@ static PyObject *LuaObject_str(PyObject *obj)
 static PyObject *LuaObject_call(PyObject *obj, PyObject *args)
 {
 	LuaStateObject *state = (LuaStateObject *)((LuaObject *)obj)->state;
-	lua_settop(state->LuaState, 0);
 	lua_rawgeti(state->LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
 	return LuaCall(state, args);
 }
@@ -393,6 +746,7 @@ static PyObject *LuaObject_iternext(LuaObject *obj)
 {
 	LuaStateObject *state = (LuaStateObject *)((LuaObject *)obj)->state;
 	lua_State *LuaState = state->LuaState;
+	int top = lua_gettop(LuaState);
 	PyObject *ret = NULL;
 
 	lua_rawgeti(state->LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
@@ -420,6 +774,7 @@ static PyObject *LuaObject_iternext(LuaObject *obj)
 		luaL_unref(state->LuaState, LUA_REGISTRYINDEX, obj->refiter);
 		obj->refiter = LUA_NOREF;
 	}
+	lua_settop(LuaState, top);
 
 	return ret;
 }
@@ -427,9 +782,10 @@ static PyObject *LuaObject_iternext(LuaObject *obj)
 static Py_ssize_t LuaObject_length(LuaObject *obj)
 {
 	LuaStateObject *state = (LuaStateObject *)((LuaObject *)obj)->state;
+	int top = lua_gettop(state->LuaState);
 	lua_rawgeti(state->LuaState, LUA_REGISTRYINDEX, ((LuaObject*)obj)->ref);
 	size_t len = lua_objlen(state->LuaState, -1);
-	lua_settop(state->LuaState, 0);
+	lua_settop(state->LuaState, top);
 	return len;
 }
 
@@ -495,177 +851,147 @@ PyTypeObject LuaObjectType = {
 };
 
 /*********************************************************************************
- * State object
+ * Sink object
  ********************************************************************************/
 
-static int LuaStateObject_init(LuaStateObject *self, PyObject *args, PyObject *kwds)
+int LuaSink_append(LuaSinkObject *sink, const char *s, size_t len)
 {
-	lua_State *NewLuaState = NULL;
-	
-	/* Create new Lua state */
-	NewLuaState = lua_newstate(py_lua_alloc, py_lua_module_panic);
-	
-	/* Open libraries for the state */
-	luaL_openlibs(NewLuaState);
-	
-	/* Store Python Lua state object in the lua_State */
-	lua_pushlightuserdata(NewLuaState, self);
-	lua_setglobal(NewLuaState, "_PyLuaState");
-	
-	/* Initialize the other side */
-	if (lua_cpcall(NewLuaState, luaopen_python, NULL) != 0) {
-		PyErr_SetString(PyExc_RuntimeError, "can't open python lib in lua");
+	if (sink->len + (Py_ssize_t)len > sink->size) {
+		Py_ssize_t size = sink->size ? sink->size : 256;
+		char *buf;
+		if (sink->exports > 0) {
+			PyErr_SetString(PyExc_BufferError,
+					"sink is exported, can't grow it");
+			return -1;
+		}
+		while (size < sink->len + (Py_ssize_t)len)
+			size *= 2;
+		buf = PyMem_Realloc(sink->buf, size);
+		if (!buf) {
+			PyErr_NoMemory();
+			return -1;
+		}
+		sink->buf = buf;
+		sink->size = size;
 	}
-	
-	/* Reset state stack */
-	lua_settop(NewLuaState, 0);
-	
-	/* Store Lua state in wrapper */
-	self->LuaState = NewLuaState;
-	
+	memcpy(sink->buf + sink->len, s, len);
+	sink->len += len;
 	return 0;
 }
 
-static void LuaStateObject_dealloc(LuaStateObject *self)
+static void LuaSinkObject_dealloc(LuaSinkObject *self)
 {
-	if (self->LuaState) {
-		lua_close(self->LuaState);
-		self->LuaState = NULL;
-	}
+	PyMem_Free(self->buf);
 	self->ob_type->tp_free((PyObject *)self);
 }
 
-static PyObject *LuaStateObject_str(PyObject *obj)
+static PyObject *LuaSinkObject_str(PyObject *obj)
 {
-	return PyString_FromFormat("<LuaState %p at %p>", ((LuaStateObject *)obj)->LuaState, obj);
+	return PyString_FromFormat("<LuaSink [%zd] at %p>",
+				   ((LuaSinkObject *)obj)->len, obj);
 }
 
-PyObject *LuaState_run(LuaStateObject *self, PyObject *args, int eval)
+static PyObject *LuaSink_getvalue(PyObject *pself, PyObject *args)
+{
+	LuaSinkObject *self = (LuaSinkObject *)pself;
+	return PyString_FromStringAndSize(self->buf ? self->buf : "", self->len);
+}
+
+static PyObject *LuaSink_write(PyObject *pself, PyObject *args)
 {
-	PyObject *ret = NULL;
-	char *buf = NULL;
 	char *s;
 	Py_ssize_t len;
-
 	if (!PyArg_ParseTuple(args, "s#", &s, &len))
-		goto error;
-
-	if (eval) {
-		size_t retlen = sizeof("return ")-1;
-		size_t lenbuf = retlen + len;
-		buf = PyMem_New(char, lenbuf+1);
-		strcpy(buf, "return ");
-		memcpy(buf+retlen, s, len);
-		buf[lenbuf] = '\0';
-		s = buf;
-		len = lenbuf;
-	}
-
-	if (luaL_loadbuffer(self->LuaState, s, len, "<python>") != 0) {
-		PyErr_Format(PyExc_RuntimeError,
-			     "error loading code: %s",
-			     lua_tostring(self->LuaState, -1));
-		goto error;
-	}
-
-	PyMem_Free(buf);
-	
-	if (lua_pcall(self->LuaState, 0, 1, 0) != 0) {
-		PyErr_Format(PyExc_RuntimeError,
-			     "error executing code: %s",
-			     lua_tostring(self->LuaState, -1));
-		goto error;
-	}
-
-	ret = LuaConvert(self, -1);
-  error:
-	lua_settop(self->LuaState, 0);
-	return ret;
+		return NULL;
+	if (LuaSink_append((LuaSinkObject *)pself, s, len) == -1)
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
-PyObject *LuaState_execute(PyObject *pself, PyObject *args)
+static PyObject *LuaSink_clear(PyObject *pself, PyObject *args)
 {
-	LuaStateObject *self = (LuaStateObject *)pself;
-	return LuaState_run(self, args, 0);
+	LuaSinkObject *self = (LuaSinkObject *)pself;
+	if (self->exports > 0) {
+		PyErr_SetString(PyExc_BufferError,
+				"sink is exported, can't clear it");
+		return NULL;
+	}
+	self->len = 0;
+	Py_INCREF(Py_None);
+	return Py_None;
 }
 
-PyObject *LuaState_eval(PyObject *pself, PyObject *args)
+static Py_ssize_t LuaSink_length(LuaSinkObject *self)
 {
-	LuaStateObject *self = (LuaStateObject *)pself;
-	return LuaState_run(self, args, 1);
+	return self->len;
 }
 
-PyObject *LuaState_globals(PyObject *pself, PyObject *args)
+static int LuaSink_getbuffer(LuaSinkObject *self, Py_buffer *view, int flags)
 {
-	LuaStateObject *self = (LuaStateObject *)pself;
-	PyObject *ret = NULL;
-	lua_pushvalue(self->LuaState, LUA_GLOBALSINDEX);
-	if (lua_isnil(self->LuaState, -1)) {
-		PyErr_SetString(PyExc_RuntimeError,
-				"lost globals reference");
-		lua_pop(self->LuaState, 1);
-		return NULL;
-	}
-	ret = LuaConvert(self, -1);
-	if (!ret)
-		PyErr_Format(PyExc_TypeError,
-			     "failed to convert globals table");
-	lua_settop(self->LuaState, 0);
-	return ret;
+	if (PyBuffer_FillInfo(view, (PyObject *)self,
+			      self->buf ? self->buf : "", self->len,
+			      1, flags) == -1)
+		return -1;
+	self->exports++;
+	return 0;
 }
 
-static PyObject *LuaState_require(PyObject *pself, PyObject *args)
+static void LuaSink_releasebuffer(LuaSinkObject *self, Py_buffer *view)
 {
-	LuaStateObject *self = (LuaStateObject *)pself;
-	lua_pushliteral(self->LuaState, "require");
-	lua_rawget(self->LuaState, LUA_GLOBALSINDEX);
-	if (lua_isnil(self->LuaState, -1)) {
-		lua_pop(self->LuaState, 1);
-		PyErr_SetString(PyExc_RuntimeError, "require is not defined");
-		return NULL;
-	}
-	return LuaCall(self, args);
+	self->exports--;
 }
 
-static PyMethodDef luastate_methods[] = {
-	{"execute",	LuaState_execute,	METH_VARARGS,		NULL},
-	{"eval",	LuaState_eval,		METH_VARARGS,		NULL},
-	{"globals",	LuaState_globals,	METH_NOARGS,		NULL},
-	{"require", 	LuaState_require,	METH_VARARGS,		NULL},
+static PyMethodDef luasink_methods[] = {
+	{"getvalue",	LuaSink_getvalue,	METH_NOARGS,		NULL},
+	{"write",	LuaSink_write,		METH_VARARGS,		NULL},
+	{"clear",	LuaSink_clear,		METH_NOARGS,		NULL},
 	{NULL,		NULL,			0,			NULL}
 };
 
-/* Python type object to hold LuaState */
-PyTypeObject LuaStateObjectType = {
+static PySequenceMethods LuaSink_as_sequence = {
+	(lenfunc)LuaSink_length,	/*sq_length*/
+};
+
+static PyBufferProcs LuaSink_as_buffer = {
+	0,				/*bf_getreadbuffer*/
+	0,				/*bf_getwritebuffer*/
+	0,				/*bf_getsegcount*/
+	0,				/*bf_getcharbuffer*/
+	(getbufferproc)LuaSink_getbuffer,	/*bf_getbuffer*/
+	(releasebufferproc)LuaSink_releasebuffer, /*bf_releasebuffer*/
+};
+
+PyTypeObject LuaSinkObjectType = {
 	PyObject_HEAD_INIT(NULL)
 	0,			/*ob_size*/
-	"lua.LuaState",		/*tp_name*/
-	sizeof(LuaStateObject),	/*tp_basicsize*/
+	"lua.LuaSink",		/*tp_name*/
+	sizeof(LuaSinkObject),	/*tp_basicsize*/
 	0,			/*tp_itemsize*/
-	(destructor)LuaStateObject_dealloc, /*tp_dealloc*/
+	(destructor)LuaSinkObject_dealloc, /*tp_dealloc*/
 	0,			/*tp_print*/
 	0,			/*tp_getattr*/
 	0,			/*tp_setattr*/
 	0,			/*tp_compare*/
-	LuaStateObject_str,	/*tp_repr*/
+	LuaSinkObject_str,	/*tp_repr*/
 	0,			/*tp_as_number*/
-	0,			/*tp_as_sequence*/
+	&LuaSink_as_sequence,	/*tp_as_sequence*/
 	0,			/*tp_as_mapping*/
 	0,			/*tp_hash*/
 	0,	     		/*tp_call*/
-	LuaStateObject_str,	/*tp_str*/
+	LuaSinkObject_str,	/*tp_str*/
 	0,			/*tp_getattro*/
 	0,			/*tp_setattro*/
-	0,			/*tp_as_buffer*/
-	Py_TPFLAGS_DEFAULT, 	/*tp_flags*/
-	"Lua state object",	/*tp_doc*/
+	&LuaSink_as_buffer,	/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+	"Output buffer written from Lua",	/*tp_doc*/
 	0,			/*tp_traverse*/
 	0,			/*tp_clear*/
 	0,			/*tp_richcompare*/
 	0,			/*tp_weaklistoffset*/
 	0,			/*tp_iter*/
 	0, 			/*tp_iternext*/
-	luastate_methods,      	/*tp_methods*/
+	luasink_methods,      	/*tp_methods*/
 	0,       		/*tp_members*/
 	0,                      /*tp_getset*/
 	0,                      /*tp_base*/
@@ -673,7 +999,7 @@ PyTypeObject LuaStateObjectType = {
 	0,                      /*tp_descr_get*/
 	0,                      /*tp_descr_set*/
 	0,                      /*tp_dictoffset*/
-	(initproc)LuaStateObject_init,	/*tp_init*/
+	0,			/*tp_init*/
 	0,			/*tp_alloc*/
 	0,			/*tp_new*/
 	0,			/*tp_free*/
@@ -681,34 +1007,2696 @@ PyTypeObject LuaStateObjectType = {
 };
 
 /*********************************************************************************
- * Module
+ * Numeric array object
  ********************************************************************************/
 
 /**
- * Proxy execute call to module global state.
+ * New zeroed array of 'n' items of the struct format 'fmt', which must
+ * be one of the formats views support.
  */
-PyObject *Lua_execute(PyObject *self, PyObject *args)
+PyObject *LuaNumArray_New(Py_ssize_t n, char fmt)
 {
-	return LuaState_execute((PyObject *)GetGlobalLuaState(), args);
+	Py_ssize_t itemsize = py_view_itemsize(fmt);
+	LuaNumArrayObject *self;
+
+	if (!itemsize) {
+		PyErr_Format(PyExc_ValueError, "unsupported format '%c'", fmt);
+		return NULL;
+	}
+	if (n < 0 || n > PY_SSIZE_T_MAX / itemsize) {
+		PyErr_SetString(PyExc_ValueError, "invalid array size");
+		return NULL;
+	}
+	self = PyObject_New(LuaNumArrayObject, &LuaNumArrayObjectType);
+	if (!self)
+		return NULL;
+	self->data = PyMem_Malloc(n ? n*itemsize : 1);
+	if (!self->data) {
+		PyObject_Del(self);
+		return PyErr_NoMemory();
+	}
+	memset(self->data, 0, n*itemsize);
+	self->len = n;
+	self->itemsize = itemsize;
+	self->fmt[0] = fmt;
+	self->fmt[1] = '\0';
+	return (PyObject *)self;
 }
 
-/**
- * Proxy eval call to module global state.
- */
-PyObject *Lua_eval(PyObject *self, PyObject *args)
+/* NumArray(n, fmt='d') */
+static PyObject *LuaNumArray_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-	return LuaState_eval((PyObject *)GetGlobalLuaState(), args);
+	static char *kwlist[] = {"n", "fmt", NULL};
+	Py_ssize_t n;
+	char fmt = 'd';
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|c:NumArray", kwlist,
+					 &n, &fmt))
+		return NULL;
+	return LuaNumArray_New(n, fmt);
 }
 
-/**
- * Proxy globals call to module global state.
- */
-PyObject *Lua_globals(PyObject *self, PyObject *args)
+static void LuaNumArray_dealloc(LuaNumArrayObject *self)
 {
-	return LuaState_globals((PyObject *)GetGlobalLuaState(), args);
+	PyMem_Free(self->data);
+	PyObject_Del(self);
 }
 
-/**
+static PyObject *LuaNumArray_str(PyObject *obj)
+{
+	LuaNumArrayObject *self = (LuaNumArrayObject *)obj;
+	return PyString_FromFormat("<NumArray '%c' [%zd] at %p>",
+				   self->fmt[0], self->len, obj);
+}
+
+static Py_ssize_t LuaNumArray_length(LuaNumArrayObject *self)
+{
+	return self->len;
+}
+
+#define NUMARRAY_GET(type, conv) { type v; memcpy(&v, p, sizeof(v)); \
+				   return conv(v); }
+#define NUMARRAY_SET(type, conv) { type v = (type)conv(value); \
+				   if (PyErr_Occurred()) return -1; \
+				   memcpy(p, &v, sizeof(v)); return 0; }
+#define NUMARRAY_SETINT(type, lo, hi) { PY_LONG_LONG n; type v; \
+				   if (numarray_signed(self, value, lo, hi, &n) == -1) \
+					   return -1; \
+				   v = (type)n; memcpy(p, &v, sizeof(v)); return 0; }
+#define NUMARRAY_SETUINT(type, hi) { unsigned PY_LONG_LONG n; type v; \
+				   if (numarray_unsigned(self, value, hi, &n) == -1) \
+					   return -1; \
+				   v = (type)n; memcpy(p, &v, sizeof(v)); return 0; }
+
+static int numarray_overflow(LuaNumArrayObject *self)
+{
+	PyErr_Format(PyExc_OverflowError,
+		     "value out of range for NumArray format '%c'", self->fmt[0]);
+	return -1;
+}
+
+/* Integer items take integers that fit the item type, as array.array does */
+static int numarray_signed(LuaNumArrayObject *self, PyObject *value,
+			   PY_LONG_LONG lo, PY_LONG_LONG hi, PY_LONG_LONG *n)
+{
+	PyObject *index = PyNumber_Index(value);
+
+	if (!index)
+		return -1;
+	*n = PyLong_AsLongLong(index);
+	Py_DECREF(index);
+	if (*n == -1 && PyErr_Occurred())
+		return -1;
+	if (*n < lo || *n > hi)
+		return numarray_overflow(self);
+	return 0;
+}
+
+static int numarray_unsigned(LuaNumArrayObject *self, PyObject *value,
+			     unsigned PY_LONG_LONG hi, unsigned PY_LONG_LONG *n)
+{
+	PyObject *index = PyNumber_Index(value);
+
+	if (!index)
+		return -1;
+	if (PyInt_Check(index)) {
+		long l = PyInt_AS_LONG(index);
+		Py_DECREF(index);
+		if (l < 0)
+			return numarray_overflow(self);
+		*n = (unsigned long)l;
+	} else {
+		*n = PyLong_AsUnsignedLongLong(index);
+		Py_DECREF(index);
+		if (*n == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred()) {
+			if (PyErr_ExceptionMatches(PyExc_OverflowError)) {
+				PyErr_Clear();
+				return numarray_overflow(self);
+			}
+			return -1;
+		}
+	}
+	if (*n > hi)
+		return numarray_overflow(self);
+	return 0;
+}
+
+static PyObject *LuaNumArray_item(LuaNumArrayObject *self, Py_ssize_t i)
+{
+	const char *p = self->data + i*self->itemsize;
+
+	if (i < 0 || i >= self->len) {
+		PyErr_SetString(PyExc_IndexError, "NumArray index out of range");
+		return NULL;
+	}
+	switch (self->fmt[0]) {
+		case 'b': NUMARRAY_GET(signed char, PyInt_FromLong)
+		case 'B': NUMARRAY_GET(unsigned char, PyInt_FromLong)
+		case 'h': NUMARRAY_GET(short, PyInt_FromLong)
+		case 'H': NUMARRAY_GET(unsigned short, PyInt_FromLong)
+		case 'i': NUMARRAY_GET(int, PyInt_FromLong)
+		case 'I': NUMARRAY_GET(unsigned int, PyLong_FromUnsignedLong)
+		case 'l': NUMARRAY_GET(long, PyInt_FromLong)
+		case 'L': NUMARRAY_GET(unsigned long, PyLong_FromUnsignedLong)
+		case 'q': NUMARRAY_GET(long long, PyLong_FromLongLong)
+		case 'Q': NUMARRAY_GET(unsigned long long, PyLong_FromUnsignedLongLong)
+		case 'f': NUMARRAY_GET(float, PyFloat_FromDouble)
+		case 'd': NUMARRAY_GET(double, PyFloat_FromDouble)
+	}
+	Py_RETURN_NONE;
+}
+
+static int LuaNumArray_ass_item(LuaNumArrayObject *self, Py_ssize_t i,
+				PyObject *value)
+{
+	char *p = self->data + i*self->itemsize;
+
+	if (i < 0 || i >= self->len) {
+		PyErr_SetString(PyExc_IndexError, "NumArray index out of range");
+		return -1;
+	}
+	if (!value) {
+		PyErr_SetString(PyExc_TypeError, "can't delete NumArray items");
+		return -1;
+	}
+	switch (self->fmt[0]) {
+		case 'b': NUMARRAY_SETINT(signed char, SCHAR_MIN, SCHAR_MAX)
+		case 'B': NUMARRAY_SETUINT(unsigned char, UCHAR_MAX)
+		case 'h': NUMARRAY_SETINT(short, SHRT_MIN, SHRT_MAX)
+		case 'H': NUMARRAY_SETUINT(unsigned short, USHRT_MAX)
+		case 'i': NUMARRAY_SETINT(int, INT_MIN, INT_MAX)
+		case 'I': NUMARRAY_SETUINT(unsigned int, UINT_MAX)
+		case 'l': NUMARRAY_SETINT(long, LONG_MIN, LONG_MAX)
+		case 'L': NUMARRAY_SETUINT(unsigned long, ULONG_MAX)
+		case 'q': NUMARRAY_SETINT(long long, LLONG_MIN, LLONG_MAX)
+		case 'Q': NUMARRAY_SETUINT(unsigned long long, ULLONG_MAX)
+		case 'f': NUMARRAY_SET(float, PyFloat_AsDouble)
+		case 'd': NUMARRAY_SET(double, PyFloat_AsDouble)
+	}
+	return 0;
+}
+
+#undef NUMARRAY_GET
+#undef NUMARRAY_SET
+#undef NUMARRAY_SETINT
+#undef NUMARRAY_SETUINT
+
+static PyObject *LuaNumArray_tolist(PyObject *pself, PyObject *args)
+{
+	LuaNumArrayObject *self = (LuaNumArrayObject *)pself;
+	PyObject *list = PyList_New(self->len), *item;
+	Py_ssize_t i;
+
+	for (i = 0; list && i != self->len; i++) {
+		item = LuaNumArray_item(self, i);
+		if (!item) {
+			Py_CLEAR(list);
+			break;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+	return list;
+}
+
+/* Same as array.array, so the array can be used as a column */
+static PyObject *LuaNumArray_typecode(PyObject *obj, void *closure)
+{
+	return PyString_FromString(((LuaNumArrayObject *)obj)->fmt);
+}
+
+static int LuaNumArray_getbuffer(LuaNumArrayObject *self, Py_buffer *view, int flags)
+{
+	view->buf = self->data;
+	view->len = self->len * self->itemsize;
+	view->readonly = 0;
+	view->itemsize = self->itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? self->fmt : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) ? &self->len : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+			&self->itemsize : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	Py_INCREF(self);
+	view->obj = (PyObject *)self;
+	return 0;
+}
+
+static PyMethodDef luanumarray_methods[] = {
+	{"tolist",	LuaNumArray_tolist,	METH_NOARGS,		NULL},
+	{NULL,		NULL,			0,			NULL}
+};
+
+static PyGetSetDef luanumarray_getset[] = {
+	{"typecode", LuaNumArray_typecode, NULL, NULL, NULL},
+	{NULL}
+};
+
+static PySequenceMethods LuaNumArray_as_sequence = {
+	(lenfunc)LuaNumArray_length,	/*sq_length*/
+	0,				/*sq_concat*/
+	0,				/*sq_repeat*/
+	(ssizeargfunc)LuaNumArray_item,	/*sq_item*/
+	0,				/*sq_slice*/
+	(ssizeobjargproc)LuaNumArray_ass_item,	/*sq_ass_item*/
+};
+
+static PyBufferProcs LuaNumArray_as_buffer = {
+	0,				/*bf_getreadbuffer*/
+	0,				/*bf_getwritebuffer*/
+	0,				/*bf_getsegcount*/
+	0,				/*bf_getcharbuffer*/
+	(getbufferproc)LuaNumArray_getbuffer,	/*bf_getbuffer*/
+	0,				/*bf_releasebuffer*/
+};
+
+PyTypeObject LuaNumArrayObjectType = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"lua.NumArray",		/*tp_name*/
+	sizeof(LuaNumArrayObject), /*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	(destructor)LuaNumArray_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	LuaNumArray_str,	/*tp_repr*/
+	0,			/*tp_as_number*/
+	&LuaNumArray_as_sequence, /*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,	     		/*tp_call*/
+	LuaNumArray_str,	/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	&LuaNumArray_as_buffer,	/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+	"Numeric array shared by Lua and Python",	/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0, 			/*tp_iternext*/
+	luanumarray_methods,	/*tp_methods*/
+	0,       		/*tp_members*/
+	luanumarray_getset,	/*tp_getset*/
+	0,                      /*tp_base*/
+	0,                      /*tp_dict*/
+	0,                      /*tp_descr_get*/
+	0,                      /*tp_descr_set*/
+	0,                      /*tp_dictoffset*/
+	0,			/*tp_init*/
+	0,			/*tp_alloc*/
+	LuaNumArray_new,	/*tp_new*/
+};
+
+/*********************************************************************************
+ * Session object
+ ********************************************************************************/
+
+static void LuaSlot_dealloc(LuaSlotObject *self)
+{
+	Py_DECREF(self->session);
+	PyObject_Del(self);
+}
+
+static PyObject *LuaSlot_str(PyObject *obj)
+{
+	LuaSlotObject *slot = (LuaSlotObject *)obj;
+	lua_State *L = slot->session->state->LuaState;
+	if (!LuaSlot_valid(slot))
+		return PyString_FromFormat("<Lua slot (released) at %p>", obj);
+	return PyString_FromFormat("<Lua %s slot %d at %p>",
+				   luaL_typename(L, slot->index),
+				   slot->index, obj);
+}
+
+PyTypeObject LuaSlotObjectType = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"lua.LuaSlot",		/*tp_name*/
+	sizeof(LuaSlotObject),	/*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	(destructor)LuaSlot_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	LuaSlot_str,		/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,	     		/*tp_call*/
+	LuaSlot_str,		/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	"Lua value kept on the stack by a session",	/*tp_doc*/
+};
+
+/* Keep the value on top of the stack as a slot of the session. */
+static PyObject *LuaSlot_New(LuaSessionObject *session)
+{
+	LuaSlotObject *slot = PyObject_New(LuaSlotObject, &LuaSlotObjectType);
+	if (slot) {
+		Py_INCREF(session);
+		slot->session = session;
+		slot->index = lua_gettop(session->state->LuaState);
+		slot->generation = session->generation;
+	}
+	return (PyObject *)slot;
+}
+
+static int LuaSession_check(LuaSessionObject *self)
+{
+	if (!self->active) {
+		PyErr_SetString(PyExc_RuntimeError, "session is not active");
+		return -1;
+	}
+	return 0;
+}
+
+/* Push a slot of this session, a LuaObject or a converted value. */
+static int LuaSession_push(LuaSessionObject *self, PyObject *o)
+{
+	if (LuaSlot_Check(o)) {
+		LuaSlotObject *slot = (LuaSlotObject *)o;
+		if (slot->session != self || !LuaSlot_valid(slot)) {
+			PyErr_SetString(PyExc_RuntimeError,
+					"slot of another or released session");
+			return 0;
+		}
+		lua_pushvalue(self->state->LuaState, slot->index);
+		return 1;
+	}
+	return e_py_convert(self->state, o, 0);
+}
+
+/* Values living in the table space stay on the stack as slots. */
+#define LuaSession_keeps(L, n) (lua_type(L, n) > LUA_TSTRING)
+
+/* The Python value for 'n': a slot for tables, functions etc. */
+static PyObject *LuaSession_result(LuaSessionObject *self, int n)
+{
+	lua_State *L = self->state->LuaState;
+	if (LuaSession_keeps(L, n)) {
+		lua_pushvalue(L, n);
+		return LuaSlot_New(self);
+	}
+	return LuaConvert(self->state, n);
+}
+
+static PyObject *LuaSession_enter(PyObject *pself, PyObject *args)
+{
+	LuaSessionObject *self = (LuaSessionObject *)pself;
+	if (self->active) {
+		PyErr_SetString(PyExc_RuntimeError, "session is already active");
+		return NULL;
+	}
+	self->base = lua_gettop(self->state->LuaState);
+	self->generation++;
+	self->active = 1;
+	self->outer = self->state->session;
+	self->state->session = pself;
+	Py_INCREF(self);
+	return pself;
+}
+
+/* Sessions are strictly nested: leaving one also ends the sessions
+ * entered after it, whose slots lie above its base. */
+static void LuaSession_leave(LuaSessionObject *self)
+{
+	LuaStateObject *state = self->state;
+	LuaSessionObject *inner;
+	lua_State *L = state->LuaState;
+
+	if (!self->active)
+		return;
+	do {
+		inner = (LuaSessionObject *)state->session;
+		inner->active = 0;
+		state->session = inner->outer;
+	} while (inner != self);
+	if (self->base < lua_gettop(L))
+		lua_settop(L, self->base);
+}
+
+static PyObject *LuaSession_exit(PyObject *pself, PyObject *args)
+{
+	LuaSession_leave((LuaSessionObject *)pself);
+	Py_INCREF(Py_False);
+	return Py_False;
+}
+
+static PyObject *LuaSession_globals(PyObject *pself, PyObject *args)
+{
+	LuaSessionObject *self = (LuaSessionObject *)pself;
+	if (LuaSession_check(self) == -1)
+		return NULL;
+	if (!lua_checkstack(self->state->LuaState, 1)) {
+		PyErr_SetString(PyExc_RuntimeError, "session stack is full");
+		return NULL;
+	}
+	lua_pushvalue(self->state->LuaState, LUA_GLOBALSINDEX);
+	return LuaSlot_New(self);
+}
+
+/**
+ * get(obj, key) - obj[key]. Tables, functions and other reference
+ * values are returned as slots, strings, numbers etc. as Python values.
+ */
+static PyObject *LuaSession_get(PyObject *pself, PyObject *args)
+{
+	LuaSessionObject *self = (LuaSessionObject *)pself;
+	lua_State *LuaState = self->state->LuaState;
+	PyObject *obj, *key, *ret = NULL;
+	int top = lua_gettop(LuaState);
+
+	if (!PyArg_ParseTuple(args, "OO", &obj, &key) ||
+	    LuaSession_check(self) == -1)
+		return NULL;
+	if (!lua_checkstack(LuaState, 3)) {
+		PyErr_SetString(PyExc_RuntimeError, "session stack is full");
+		return NULL;
+	}
+	if (!LuaSession_push(self, obj) || !LuaSession_push(self, key))
+		goto error;
+	TRY {
+		lua_gettable(LuaState, -2);
+	} CATCH {
+		PyErr_SetString(PyExc_RuntimeError, "error indexing lua value");
+		goto error;
+	} ENDTRY;
+
+	if (LuaSession_keeps(LuaState, -1)) {
+		lua_remove(LuaState, -2);
+		return LuaSlot_New(self);
+	}
+	ret = LuaConvert(self->state, -1);
+  error:
+	lua_settop(LuaState, top);
+	return ret;
+}
+
+/* set(obj, key, value) - obj[key] = value. */
+static PyObject *LuaSession_set(PyObject *pself, PyObject *args)
+{
+	LuaSessionObject *self = (LuaSessionObject *)pself;
+	lua_State *LuaState = self->state->LuaState;
+	PyObject *obj, *key, *value, *ret = NULL;
+	int top = lua_gettop(LuaState);
+
+	if (!PyArg_ParseTuple(args, "OOO", &obj, &key, &value) ||
+	    LuaSession_check(self) == -1)
+		return NULL;
+	if (!lua_checkstack(LuaState, 3)) {
+		PyErr_SetString(PyExc_RuntimeError, "session stack is full");
+		return NULL;
+	}
+	if (!LuaSession_push(self, obj) || !LuaSession_push(self, key) ||
+	    !LuaSession_push(self, value))
+		goto error;
+	TRY {
+		lua_settable(LuaState, -3);
+	} CATCH {
+		PyErr_SetString(PyExc_RuntimeError, "error indexing lua value");
+		goto error;
+	} ENDTRY;
+
+	Py_INCREF(Py_None);
+	ret = Py_None;
+  error:
+	lua_settop(LuaState, top);
+	return ret;
+}
+
+/**
+ * call(fn, *args) - call fn, returning None, a value or a tuple, with
+ * reference values as slots. Results stay on the stack until exit.
+ */
+static PyObject *LuaSession_call(PyObject *pself, PyObject *args)
+{
+	LuaSessionObject *self = (LuaSessionObject *)pself;
+	lua_State *L = self->state->LuaState;
+	PyObject *ret = NULL, *value;
+	int top = lua_gettop(L);
+	int i, n = (int)PyTuple_GET_SIZE(args);
+
+	if (LuaSession_check(self) == -1)
+		return NULL;
+	if (n < 1) {
+		PyErr_SetString(PyExc_TypeError, "call() needs a function");
+		return NULL;
+	}
+	if (!lua_checkstack(L, n)) {
+		PyErr_SetString(PyExc_RuntimeError, "session stack is full");
+		return NULL;
+	}
+	for (i = 0; i != n; i++)
+		if (!LuaSession_push(self, PyTuple_GET_ITEM(args, i)))
+			goto error;
+	if (lua_pcall(L, n - 1, LUA_MULTRET, 0) != 0) {
+		LuaState_seterror(self->state, PyExc_Exception, "error");
+		goto error;
+	}
+
+	n = lua_gettop(L) - top;
+	if (n == 0) {
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+	if (n == 1)
+		return LuaSession_result(self, top + 1);
+	ret = PyTuple_New(n);
+	for (i = 0; ret && i != n; i++) {
+		value = LuaSession_result(self, top + 1 + i);
+		if (!value) {
+			Py_CLEAR(ret);
+			break;
+		}
+		PyTuple_SET_ITEM(ret, i, value);
+	}
+	return ret;
+  error:
+	lua_settop(L, top);
+	return ret;
+}
+
+/* value(slot) - the slot's value as a LuaObject that outlives the session. */
+static PyObject *LuaSession_value(PyObject *pself, PyObject *o)
+{
+	LuaSessionObject *self = (LuaSessionObject *)pself;
+	lua_State *L = self->state->LuaState;
+	PyObject *ret;
+
+	if (LuaSession_check(self) == -1 || !LuaSession_push(self, o))
+		return NULL;
+	ret = LuaConvert(self->state, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+static void LuaSession_dealloc(LuaSessionObject *self)
+{
+	LuaSession_leave(self);
+	Py_DECREF(self->state);
+	PyObject_Del(self);
+}
+
+static PyMethodDef luasession_methods[] = {
+	{"__enter__",	LuaSession_enter,	METH_NOARGS,		NULL},
+	{"__exit__",	LuaSession_exit,	METH_VARARGS,		NULL},
+	{"globals",	LuaSession_globals,	METH_NOARGS,		NULL},
+	{"get",		LuaSession_get,		METH_VARARGS,		NULL},
+	{"set",		LuaSession_set,		METH_VARARGS,		NULL},
+	{"call",	LuaSession_call,	METH_VARARGS,		NULL},
+	{"value",	LuaSession_value,	METH_O,			NULL},
+	{NULL,		NULL,			0,			NULL}
+};
+
+PyTypeObject LuaSessionObjectType = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"lua.LuaSession",	/*tp_name*/
+	sizeof(LuaSessionObject), /*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	(destructor)LuaSession_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	0,			/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,	     		/*tp_call*/
+	0,			/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	"Batch of operations sharing the Lua stack",	/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0, 			/*tp_iternext*/
+	luasession_methods,	/*tp_methods*/
+};
+
+/*********************************************************************************
+ * Record types
+ ********************************************************************************/
+
+/* Push the record 't' and the key table, checking room for 'n' more. */
+static int LuaRecordType_push(LuaRecordTypeObject *self, PyObject *t, int n)
+{
+	lua_State *L = self->state->LuaState;
+
+	if (!lua_checkstack(L, n + 2)) {
+		PyErr_SetString(PyExc_RuntimeError, "lua stack is full");
+		return 0;
+	}
+	if (!e_py_convert(self->state, t, 0))
+		return 0;
+	if (!lua_istable(L, -1)) {
+		PyErr_SetString(PyExc_TypeError, "Lua object is not a table");
+		return 0;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, self->keys);
+	return 1;
+}
+
+/* get(t) - the fields of record 't' as a tuple. */
+static PyObject *LuaRecordType_get(PyObject *pself, PyObject *t)
+{
+	LuaRecordTypeObject *self = (LuaRecordTypeObject *)pself;
+	lua_State *LuaState = self->state->LuaState;
+	int top = lua_gettop(LuaState);
+	int i, n = (int)self->nfields;
+	PyObject *ret = NULL, *value;
+
+	if (!LuaRecordType_push(self, t, n))
+		goto error;
+	TRY {
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(LuaState, top + 2, i);
+			lua_gettable(LuaState, top + 1);
+		}
+	} CATCH {
+		PyErr_SetString(PyExc_RuntimeError, "error reading record");
+		goto error;
+	} ENDTRY;
+
+	ret = PyTuple_New(n);
+	for (i = 0; ret && i != n; i++) {
+		value = LuaConvert(self->state, top + 3 + i);
+		if (!value) {
+			Py_CLEAR(ret);
+			break;
+		}
+		PyTuple_SET_ITEM(ret, i, value);
+	}
+  error:
+	lua_settop(LuaState, top);
+	return ret;
+}
+
+/* set(t, values) - set the fields of record 't' from a sequence. */
+static PyObject *LuaRecordType_set(PyObject *pself, PyObject *args)
+{
+	LuaRecordTypeObject *self = (LuaRecordTypeObject *)pself;
+	lua_State *LuaState = self->state->LuaState;
+	int top = lua_gettop(LuaState);
+	int i, n = (int)self->nfields;
+	PyObject *t, *values, *seq = NULL, *ret = NULL;
+
+	if (!PyArg_ParseTuple(args, "OO", &t, &values))
+		return NULL;
+	seq = PySequence_Fast(values, "values must be a sequence");
+	if (!seq)
+		return NULL;
+	if (PySequence_Fast_GET_SIZE(seq) != n) {
+		PyErr_Format(PyExc_ValueError, "expected %d values", n);
+		goto error;
+	}
+	if (!LuaRecordType_push(self, t, 2*n))
+		goto error;
+	for (i = 0; i != n; i++)
+		if (!e_py_convert(self->state, PySequence_Fast_GET_ITEM(seq, i), 0))
+			goto error;
+	TRY {
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(LuaState, top + 2, i);
+			lua_pushvalue(LuaState, top + 2 + i);
+			lua_settable(LuaState, top + 1);
+		}
+	} CATCH {
+		PyErr_SetString(PyExc_RuntimeError, "error writing record");
+		goto error;
+	} ENDTRY;
+
+	Py_INCREF(Py_None);
+	ret = Py_None;
+  error:
+	Py_XDECREF(seq);
+	lua_settop(LuaState, top);
+	return ret;
+}
+
+/* wrap(t) - a proxy reading and writing the fields as attributes. */
+static PyObject *LuaRecordType_wrap(PyObject *pself, PyObject *t)
+{
+	LuaRecordTypeObject *self = (LuaRecordTypeObject *)pself;
+	lua_State *L = self->state->LuaState;
+	int top = lua_gettop(L);
+	LuaRecordObject *rec;
+
+	if (!LuaRecordType_push(self, t, 0)) {
+		lua_settop(L, top);
+		return NULL;
+	}
+	lua_pop(L, 1);
+	rec = PyObject_New(LuaRecordObject, &LuaRecordObjectType);
+	if (!rec) {
+		lua_settop(L, top);
+		return NULL;
+	}
+	Py_INCREF(self);
+	rec->type = self;
+	rec->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return (PyObject *)rec;
+}
+
+static void LuaRecordType_dealloc(LuaRecordTypeObject *self)
+{
+	luaL_unref(self->state->LuaState, LUA_REGISTRYINDEX, self->keys);
+	Py_DECREF(self->state);
+	Py_DECREF(self->fields);
+	Py_XDECREF(self->index);
+	PyObject_Del(self);
+}
+
+static PyObject *LuaRecordType_str(PyObject *obj)
+{
+	PyObject *fields = PyObject_Repr(((LuaRecordTypeObject *)obj)->fields);
+	PyObject *ret = NULL;
+	if (fields) {
+		ret = PyString_FromFormat("<LuaRecordType %s at %p>",
+					  PyString_AS_STRING(fields), obj);
+		Py_DECREF(fields);
+	}
+	return ret;
+}
+
+static PyMethodDef luarecordtype_methods[] = {
+	{"get",		LuaRecordType_get,	METH_O,			NULL},
+	{"set",		LuaRecordType_set,	METH_VARARGS,		NULL},
+	{"wrap",	LuaRecordType_wrap,	METH_O,			NULL},
+	{NULL,		NULL,			0,			NULL}
+};
+
+static PyMemberDef luarecordtype_members[] = {
+	{"fields", T_OBJECT, offsetof(LuaRecordTypeObject, fields), READONLY, NULL},
+	{NULL}
+};
+
+PyTypeObject LuaRecordTypeObjectType = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"lua.LuaRecordType",	/*tp_name*/
+	sizeof(LuaRecordTypeObject), /*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	(destructor)LuaRecordType_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	LuaRecordType_str,	/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,	     		/*tp_call*/
+	LuaRecordType_str,	/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	"Accessor for Lua tables with a fixed set of fields",	/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0, 			/*tp_iternext*/
+	luarecordtype_methods,	/*tp_methods*/
+	luarecordtype_members,	/*tp_members*/
+};
+
+/* Push the record of 'rec' and its key for 'attr'; -1 if not a field. */
+static int LuaRecord_pushfield(LuaRecordObject *rec, PyObject *attr)
+{
+	lua_State *L = rec->type->state->LuaState;
+	PyObject *i = PyDict_GetItem(rec->type->index, attr);
+
+	if (!i)
+		return -1;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, rec->ref);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, rec->type->keys);
+	lua_rawgeti(L, -1, (int)PyInt_AS_LONG(i));
+	lua_remove(L, -2);
+	return 0;
+}
+
+static PyObject *LuaRecord_getattr(PyObject *obj, PyObject *attr)
+{
+	LuaRecordObject *rec = (LuaRecordObject *)obj;
+	LuaStateObject *state = rec->type->state;
+	lua_State *LuaState = state->LuaState;
+	int top = lua_gettop(LuaState);
+	PyObject *ret = NULL;
+
+	if (LuaRecord_pushfield(rec, attr) == -1)
+		return PyObject_GenericGetAttr(obj, attr);
+	TRY {
+		lua_gettable(LuaState, -2);
+	} CATCH {
+		PyErr_SetString(PyExc_RuntimeError, "error reading record");
+		goto error;
+	} ENDTRY;
+	ret = LuaConvert(state, -1);
+  error:
+	lua_settop(LuaState, top);
+	return ret;
+}
+
+static int LuaRecord_setattr(PyObject *obj, PyObject *attr, PyObject *value)
+{
+	LuaRecordObject *rec = (LuaRecordObject *)obj;
+	LuaStateObject *state = rec->type->state;
+	lua_State *LuaState = state->LuaState;
+	int top = lua_gettop(LuaState);
+	int ret = -1;
+
+	if (LuaRecord_pushfield(rec, attr) == -1) {
+		PyErr_SetObject(PyExc_AttributeError, attr);
+		return -1;
+	}
+	if (!(value ? e_py_convert(state, value, 0) : (lua_pushnil(LuaState), 1)))
+		goto error;
+	TRY {
+		lua_settable(LuaState, -3);
+	} CATCH {
+		PyErr_SetString(PyExc_RuntimeError, "error writing record");
+		goto error;
+	} ENDTRY;
+	ret = 0;
+  error:
+	lua_settop(LuaState, top);
+	return ret;
+}
+
+static void LuaRecord_dealloc(LuaRecordObject *self)
+{
+	luaL_unref(self->type->state->LuaState, LUA_REGISTRYINDEX, self->ref);
+	Py_DECREF(self->type);
+	PyObject_Del(self);
+}
+
+/* The proxied table, as a LuaObject */
+static PyObject *LuaRecord_table(PyObject *obj, void *closure)
+{
+	LuaRecordObject *rec = (LuaRecordObject *)obj;
+	lua_State *L = rec->type->state->LuaState;
+	PyObject *ret;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, rec->ref);
+	ret = LuaConvert(rec->type->state, -1);
+	lua_pop(L, 1);
+	return ret;
+}
+
+static PyGetSetDef luarecord_getset[] = {
+	{"_table", LuaRecord_table, NULL, NULL, NULL},
+	{NULL}
+};
+
+PyTypeObject LuaRecordObjectType = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"lua.LuaRecord",	/*tp_name*/
+	sizeof(LuaRecordObject), /*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	(destructor)LuaRecord_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	0,			/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,	     		/*tp_call*/
+	0,			/*tp_str*/
+	LuaRecord_getattr,	/*tp_getattro*/
+	LuaRecord_setattr,	/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT,	/*tp_flags*/
+	"Attribute proxy for a Lua record table",	/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0, 			/*tp_iternext*/
+	0,			/*tp_methods*/
+	0,			/*tp_members*/
+	luarecord_getset,	/*tp_getset*/
+};
+
+/*********************************************************************************
+ * Frozen tables
+ ********************************************************************************/
+
+/**
+ * The mapping for the frozen proxy at 'n', built on first use and then
+ * shared until released. Nested frozen tables become nested mappings.
+ */
+static PyObject *LuaFrozen_New(LuaStateObject *state, int n)
+{
+	lua_State *L = state->LuaState;
+	py_frozen *p;
+	LuaFrozenObject *self;
+	PyObject *key, *value;
+	int rc;
+
+	if (n < 0 && n > LUA_REGISTRYINDEX)
+		n = lua_gettop(L) + n + 1;
+	p = (py_frozen *)lua_touserdata(L, n);
+	if (p->frozen) {
+		Py_INCREF(p->frozen);
+		return p->frozen;
+	}
+
+	self = PyObject_GC_New(LuaFrozenObject, &LuaFrozenObjectType);
+	if (!self)
+		return NULL;
+	Py_INCREF(state);
+	self->state = state;
+	lua_pushvalue(L, n);
+	self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	self->dict = PyDict_New();
+	if (!self->dict) {
+		Py_DECREF(self);
+		return NULL;
+	}
+	/* Set before filling, so cycles come back to this object */
+	p->frozen = (PyObject *)self;
+
+	lua_getfenv(L, n);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		key = LuaConvert(state, -2);
+		value = key ? LuaConvert(state, -1) : NULL;
+		rc = value ? PyDict_SetItem(self->dict, key, value) : -1;
+		Py_XDECREF(key);
+		Py_XDECREF(value);
+		lua_pop(L, 1);
+		if (rc == -1) {
+			lua_pop(L, 2);
+			Py_DECREF(self);
+			return NULL;
+		}
+	}
+	lua_pop(L, 1);
+	PyObject_GC_Track(self);
+	return (PyObject *)self;
+}
+
+static void LuaFrozen_dealloc(LuaFrozenObject *self)
+{
+	lua_State *L = self->state->LuaState;
+	py_frozen *p;
+
+	PyObject_GC_UnTrack(self);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+	p = (py_frozen *)lua_touserdata(L, -1);
+	if (p && p->frozen == (PyObject *)self)
+		p->frozen = NULL;
+	lua_pop(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, self->ref);
+	Py_XDECREF(self->dict);
+	Py_DECREF(self->state);
+	PyObject_GC_Del(self);
+}
+
+static int LuaFrozen_traverse(LuaFrozenObject *self, visitproc visit, void *arg)
+{
+	Py_VISIT(self->dict);
+	return 0;
+}
+
+static int LuaFrozen_clear(LuaFrozenObject *self)
+{
+	Py_CLEAR(self->dict);
+	return 0;
+}
+
+/* Methods, then fields for other names; t[key] always reads fields */
+static PyObject *LuaFrozen_getattr(PyObject *obj, PyObject *attr)
+{
+	PyObject *dict = ((LuaFrozenObject *)obj)->dict;
+	PyObject *value = PyObject_GenericGetAttr(obj, attr);
+
+	if (value || !dict || !PyErr_ExceptionMatches(PyExc_AttributeError))
+		return value;
+	value = PyDict_GetItem(dict, attr);
+	if (value) {
+		PyErr_Clear();
+		Py_INCREF(value);
+	}
+	return value;
+}
+
+static PyObject *LuaFrozen_subscript(PyObject *obj, PyObject *key)
+{
+	PyObject *dict = ((LuaFrozenObject *)obj)->dict;
+	PyObject *value = dict ? PyDict_GetItem(dict, key) : NULL;
+
+	if (!value) {
+		if (!PyErr_Occurred())
+			PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+	Py_INCREF(value);
+	return value;
+}
+
+static Py_ssize_t LuaFrozen_length(PyObject *obj)
+{
+	PyObject *dict = ((LuaFrozenObject *)obj)->dict;
+	return dict ? PyDict_Size(dict) : 0;
+}
+
+static int LuaFrozen_contains(PyObject *obj, PyObject *key)
+{
+	PyObject *dict = ((LuaFrozenObject *)obj)->dict;
+	return dict ? PyDict_Contains(dict, key) : 0;
+}
+
+static PyObject *LuaFrozen_iter(PyObject *obj)
+{
+	PyObject *dict = ((LuaFrozenObject *)obj)->dict;
+	if (!dict) {
+		PyErr_SetString(PyExc_RuntimeError, "frozen table was cleared");
+		return NULL;
+	}
+	return PyObject_GetIter(dict);
+}
+
+/* Methods delegate to the dict; copy() returns it as a plain dict. */
+static PyObject *LuaFrozen_delegate(PyObject *obj, const char *name, PyObject *args)
+{
+	PyObject *dict = ((LuaFrozenObject *)obj)->dict;
+	PyObject *meth, *ret;
+
+	if (!dict) {
+		PyErr_SetString(PyExc_RuntimeError, "frozen table was cleared");
+		return NULL;
+	}
+	meth = PyObject_GetAttrString(dict, name);
+	if (!meth)
+		return NULL;
+	ret = PyObject_Call(meth, args, NULL);
+	Py_DECREF(meth);
+	return ret;
+}
+
+static PyObject *LuaFrozen_get(PyObject *obj, PyObject *args)
+{
+	return LuaFrozen_delegate(obj, "get", args);
+}
+
+static PyObject *LuaFrozen_keys(PyObject *obj, PyObject *args)
+{
+	return LuaFrozen_delegate(obj, "keys", args);
+}
+
+static PyObject *LuaFrozen_values(PyObject *obj, PyObject *args)
+{
+	return LuaFrozen_delegate(obj, "values", args);
+}
+
+static PyObject *LuaFrozen_items(PyObject *obj, PyObject *args)
+{
+	return LuaFrozen_delegate(obj, "items", args);
+}
+
+static PyObject *LuaFrozen_copy(PyObject *obj, PyObject *args)
+{
+	return LuaFrozen_delegate(obj, "copy", args);
+}
+
+static PyObject *LuaFrozen_str(PyObject *obj)
+{
+	return PyString_FromFormat("<LuaFrozen with %zd items at %p>",
+				   LuaFrozen_length(obj), obj);
+}
+
+static PyMethodDef luafrozen_methods[] = {
+	{"get",		LuaFrozen_get,		METH_VARARGS,		NULL},
+	{"keys",	LuaFrozen_keys,		METH_VARARGS,		NULL},
+	{"values",	LuaFrozen_values,	METH_VARARGS,		NULL},
+	{"items",	LuaFrozen_items,	METH_VARARGS,		NULL},
+	{"copy",	LuaFrozen_copy,		METH_VARARGS,		NULL},
+	{NULL,		NULL,			0,			NULL}
+};
+
+static PyMappingMethods LuaFrozen_as_mapping = {
+	LuaFrozen_length,	/*mp_length*/
+	LuaFrozen_subscript,	/*mp_subscript*/
+	0,			/*mp_ass_subscript*/
+};
+
+static PySequenceMethods LuaFrozen_as_sequence = {
+	0,			/*sq_length*/
+	0,			/*sq_concat*/
+	0,			/*sq_repeat*/
+	0,			/*sq_item*/
+	0,			/*sq_slice*/
+	0,			/*sq_ass_item*/
+	0,			/*sq_ass_slice*/
+	LuaFrozen_contains,	/*sq_contains*/
+};
+
+PyTypeObject LuaFrozenObjectType = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"lua.LuaFrozen",	/*tp_name*/
+	sizeof(LuaFrozenObject), /*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	(destructor)LuaFrozen_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	LuaFrozen_str,		/*tp_repr*/
+	0,			/*tp_as_number*/
+	&LuaFrozen_as_sequence,	/*tp_as_sequence*/
+	&LuaFrozen_as_mapping,	/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,	     		/*tp_call*/
+	LuaFrozen_str,		/*tp_str*/
+	LuaFrozen_getattr,	/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+	"Immutable mapping of a frozen Lua table",	/*tp_doc*/
+	(traverseproc)LuaFrozen_traverse, /*tp_traverse*/
+	(inquiry)LuaFrozen_clear, /*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	LuaFrozen_iter,		/*tp_iter*/
+	0, 			/*tp_iternext*/
+	luafrozen_methods,	/*tp_methods*/
+};
+
+/*********************************************************************************
+ * State object
+ ********************************************************************************/
+
+/* Libraries a state can open, besides base which is always open */
+static const luaL_Reg LuaState_libs[] = {
+	{LUA_LOADLIBNAME,	luaopen_package},
+	{LUA_TABLIBNAME,	luaopen_table},
+	{LUA_IOLIBNAME,		luaopen_io},
+	{LUA_OSLIBNAME,		luaopen_os},
+	{LUA_STRLIBNAME,	luaopen_string},
+	{LUA_MATHLIBNAME,	luaopen_math},
+	{LUA_DBLIBNAME,		luaopen_debug},
+	{NULL,			NULL}
+};
+
+static const luaL_Reg *LuaState_findlib(const char *name)
+{
+	const luaL_Reg *lib;
+	for (lib = LuaState_libs; lib->name; lib++)
+		if (strcmp(lib->name, name) == 0)
+			return lib;
+	return NULL;
+}
+
+static void LuaState_openlib(lua_State *L, const luaL_Reg *lib)
+{
+	lua_pushcfunction(L, lib->func);
+	lua_pushstring(L, lib->name);
+	lua_call(L, 1, 0);
+}
+
+/**
+ * __index of the globals (and strings) of a state with lazy libraries.
+ * The first upvalue maps the globals each pending library defines to
+ * its name; the first touch opens the library and forgets its globals.
+ * Once none are left, the globals lose the metatable (the second
+ * upvalue) again, unless Lua code has replaced it since.
+ */
+static int LuaState_lazyindex(lua_State *L)
+{
+	const char *name;
+
+	lua_settop(L, 2);
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		/* Method call on a string: string library */
+		lua_pushliteral(L, LUA_STRLIBNAME);
+	} else {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		if (lua_isnil(L, -1))
+			return 1;
+	}
+	name = lua_tostring(L, -1);
+
+	lua_pushnil(L);
+	while (lua_next(L, lua_upvalueindex(1)) != 0) {
+		if (lua_rawequal(L, -1, 3)) {
+			lua_pushvalue(L, -2);
+			lua_pushnil(L);
+			lua_rawset(L, lua_upvalueindex(1));
+		}
+		lua_pop(L, 1);
+	}
+	LuaState_openlib(L, LuaState_findlib(name));
+
+	lua_pushnil(L);
+	if (lua_next(L, lua_upvalueindex(1)) == 0 &&
+	    lua_getmetatable(L, LUA_GLOBALSINDEX) &&
+	    lua_rawequal(L, -1, lua_upvalueindex(2))) {
+		lua_pushnil(L);
+		lua_setmetatable(L, LUA_GLOBALSINDEX);
+	}
+	lua_settop(L, 3);
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		lua_getglobal(L, LUA_STRLIBNAME);
+		lua_pushvalue(L, 2);
+		lua_gettable(L, -2);
+	} else {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, 1);
+	}
+	return 1;
+}
+
+/* Make 'lib' open on first use of the globals it defines. */
+static void LuaState_lazylib(lua_State *L, int pending, const luaL_Reg *lib)
+{
+	lua_pushstring(L, lib->name);
+	lua_setfield(L, pending, lib->name);
+	if (lib->func == luaopen_package) {
+		lua_pushstring(L, lib->name);
+		lua_setfield(L, pending, "require");
+		lua_pushstring(L, lib->name);
+		lua_setfield(L, pending, "module");
+	}
+}
+
+struct LuaState_options {
+	PyObject *libs;
+	int lazy;
+};
+
+/* Open the requested libraries; called through lua_cpcall. */
+static int LuaState_openlibs(lua_State *L)
+{
+	struct LuaState_options *opts = lua_touserdata(L, 1);
+	const luaL_Reg *lib;
+	Py_ssize_t i, n = 0;
+	int pending = 0, mt;
+
+	lua_pushcfunction(L, luaopen_base);
+	lua_pushliteral(L, "");
+	lua_call(L, 1, 0);
+
+	if (opts->lazy) {
+		lua_newtable(L);
+		pending = lua_gettop(L);
+	}
+	if (opts->libs)
+		n = PySequence_Fast_GET_SIZE(opts->libs);
+	for (i = 0; opts->libs ? i != n : LuaState_libs[i].name != NULL; i++) {
+		if (opts->libs) {
+			PyObject *o = PySequence_Fast_GET_ITEM(opts->libs, i);
+			lib = LuaState_findlib(PyString_AS_STRING(o));
+			if (!lib)
+				continue; /* base */
+		} else {
+			lib = &LuaState_libs[i];
+		}
+		if (pending)
+			LuaState_lazylib(L, pending, lib);
+		else
+			LuaState_openlib(L, lib);
+	}
+	if (!pending)
+		return 0;
+	lua_pushnil(L);
+	if (lua_next(L, pending) == 0)
+		return 0;
+	lua_pop(L, 2);
+
+	/* Globals; a new state's have no metatable of their own */
+	lua_createtable(L, 0, 1);
+	mt = lua_gettop(L);
+	lua_pushvalue(L, pending);
+	lua_pushvalue(L, mt);
+	lua_pushcclosure(L, LuaState_lazyindex, 2);
+	lua_setfield(L, mt, "__index");
+	lua_pushvalue(L, mt);
+	lua_setmetatable(L, LUA_GLOBALSINDEX);
+
+	/* Strings, until the string library replaces it */
+	lua_getfield(L, pending, LUA_STRLIBNAME);
+	if (!lua_isnil(L, -1)) {
+		lua_pushliteral(L, "");
+		lua_createtable(L, 0, 1);
+		lua_pushvalue(L, pending);
+		lua_pushvalue(L, mt);
+		lua_pushcclosure(L, LuaState_lazyindex, 2);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, -2);
+	}
+	return 0;
+}
+
+/* Hide the python module from Lua code, keeping its metatables. */
+static int LuaState_hidebridge(lua_State *L)
+{
+	lua_pushnil(L);
+	lua_setglobal(L, "python");
+	lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+	lua_pushnil(L);
+	lua_setfield(L, -2, "python");
+	return 0;
+}
+
+/**
+ * LuaState(libs=None, python_bridge=True, lazy=False). 'libs' lists the
+ * standard libraries to open besides base, all of them by default. With
+ * 'lazy', each library is opened when a script first uses its global.
+ * Without 'python_bridge', the python module isn't visible to Lua.
+ */
+static int LuaStateObject_init(LuaStateObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"libs", "python_bridge", "lazy", NULL};
+	struct LuaState_options opts = {NULL, 0};
+	lua_State *NewLuaState = NULL;
+	PyObject *libs = Py_None;
+	int bridge = 1;
+	Py_ssize_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oii", kwlist,
+					 &libs, &bridge, &opts.lazy))
+		return -1;
+	if (libs != Py_None) {
+		opts.libs = PySequence_Fast(libs, "libs must be a sequence");
+		if (!opts.libs)
+			return -1;
+		for (i = 0; i != PySequence_Fast_GET_SIZE(opts.libs); i++) {
+			PyObject *o = PySequence_Fast_GET_ITEM(opts.libs, i);
+			if (!PyString_Check(o)) {
+				PyErr_SetString(PyExc_TypeError,
+						"library names must be strings");
+				goto error;
+			}
+			if (strcmp(PyString_AS_STRING(o), "base") != 0 &&
+			    !LuaState_findlib(PyString_AS_STRING(o))) {
+				PyErr_Format(PyExc_ValueError,
+					     "unknown library '%s'",
+					     PyString_AS_STRING(o));
+				goto error;
+			}
+		}
+	}
+	
+	/* Create new Lua state */
+	NewLuaState = lua_newstate(py_lua_alloc, py_lua_module_panic);
+	
+	/* Open libraries for the state */
+	if (lua_cpcall(NewLuaState, LuaState_openlibs, &opts) != 0) {
+		PyErr_SetString(PyExc_RuntimeError, "can't open lua libraries");
+		lua_close(NewLuaState);
+		goto error;
+	}
+	Py_XDECREF(opts.libs);
+	
+	/* Store Python Lua state object in the lua_State */
+	lua_pushlightuserdata(NewLuaState, self);
+	lua_setglobal(NewLuaState, "_PyLuaState");
+	
+	/* Initialize the other side */
+	if (lua_cpcall(NewLuaState, luaopen_python, NULL) != 0) {
+		PyErr_SetString(PyExc_RuntimeError, "can't open python lib in lua");
+	}
+	if (!bridge)
+		lua_cpcall(NewLuaState, LuaState_hidebridge, NULL);
+	
+	/* Reset state stack */
+	lua_settop(NewLuaState, 0);
+	
+	/* Store Lua state in wrapper */
+	self->LuaState = NewLuaState;
+	self->session = NULL;
+	
+	return 0;
+  error:
+	Py_XDECREF(opts.libs);
+	return -1;
+}
+
+/**
+ * Python side of a state created by a Lua host. The state isn't ours to
+ * close, so the object is never released: LuaObjects made in the state
+ * may outlive it in Python, and nothing tells us when the host closes
+ * it. This is deliberate; the object and its string caches (a few KB,
+ * allocated on first use) live for the rest of the process, once per
+ * state that loads the python module.
+ */
+LuaStateObject *LuaState_borrow(lua_State *L)
+{
+	LuaStateObject *self = PyObject_New(LuaStateObject, &LuaStateObjectType);
+	if (self) {
+		self->LuaState = L;
+		self->strcache = NULL;
+		self->refcache = NULL;
+		self->session = NULL;
+	}
+	return self;
+}
+
+static void LuaStateObject_dealloc(LuaStateObject *self)
+{
+	LuaStringCache_clear(self);
+	LuaStringRef_clear(self);
+	if (self->LuaState) {
+		lua_close(self->LuaState);
+		self->LuaState = NULL;
+	}
+	self->ob_type->tp_free((PyObject *)self);
+}
+
+static PyObject *LuaStateObject_str(PyObject *obj)
+{
+	return PyString_FromFormat("<LuaState %p at %p>", ((LuaStateObject *)obj)->LuaState, obj);
+}
+
+PyObject *LuaState_run(LuaStateObject *self, PyObject *args, int eval)
+{
+	int top = lua_gettop(self->LuaState);
+	PyObject *ret = NULL;
+	char *buf = NULL;
+	char *s;
+	Py_ssize_t len;
+
+	if (!PyArg_ParseTuple(args, "s#", &s, &len))
+		goto error;
+
+	if (eval) {
+		size_t retlen = sizeof("return ")-1;
+		size_t lenbuf = retlen + len;
+		buf = PyMem_New(char, lenbuf+1);
+		strcpy(buf, "return ");
+		memcpy(buf+retlen, s, len);
+		buf[lenbuf] = '\0';
+		s = buf;
+		len = lenbuf;
+	}
+
+	if (luaL_loadbuffer(self->LuaState, s, len, "<python>") != 0) {
+		PyErr_Format(PyExc_RuntimeError,
+			     "error loading code: %s",
+			     lua_tostring(self->LuaState, -1));
+		goto error;
+	}
+
+	PyMem_Free(buf);
+	
+	if (lua_pcall(self->LuaState, 0, 1, 0) != 0) {
+		LuaState_seterror(self, PyExc_RuntimeError,
+				  "error executing code");
+		goto error;
+	}
+
+	ret = LuaConvert(self, -1);
+  error:
+	lua_settop(self->LuaState, top);
+	return ret;
+}
+
+PyObject *LuaState_execute(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	return LuaState_run(self, args, 0);
+}
+
+PyObject *LuaState_eval(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	return LuaState_run(self, args, 1);
+}
+
+/* Read up to 'len' bytes of 'fd' into a new buffer, setting 'len' to
+ * the number read. */
+static char *LuaState_readfd(int fd, const char *path, size_t *len)
+{
+	char *data = PyMem_Malloc(*len);
+	size_t got = 0;
+	Py_ssize_t n;
+
+	if (!data) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+	while (got < *len) {
+		n = read(fd, data + got, *len - got);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+			PyMem_Free(data);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		got += n;
+	}
+	*len = got;
+	return data;
+}
+
+/**
+ * Compile the file at 'path' and leave the chunk on the stack. Where
+ * possible the file is memory-mapped, so the source is never copied
+ * into Python memory; otherwise it is read into a temporary buffer.
+ */
+static int LuaState_loadfile(LuaStateObject *self, const char *path)
+{
+	struct stat st;
+	const char *buf = "";
+	size_t len = 0, skip = 0;
+	void *map = NULL;
+	char *copy = NULL;
+	int top = lua_gettop(self->LuaState);
+	int fd, rc;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+		return -1;
+	}
+	if (fstat(fd, &st) == -1) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, (char *)path);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size > 0) {
+		len = st.st_size;
+#ifdef HAVE_MMAP
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+		buf = (const char *)map;
+#endif
+		if (!map) {
+			copy = LuaState_readfd(fd, path, &len);
+			if (!copy) {
+				close(fd);
+				return -1;
+			}
+			buf = copy;
+		}
+	}
+	close(fd);
+
+	/* Skip a '#' first line, like luaL_loadfile (keeping the newline
+	 * so line numbers stay right). */
+	if (len > 0 && buf[0] == '#')
+		while (skip < len && buf[skip] != '\n')
+			skip++;
+
+	lua_pushfstring(self->LuaState, "@%s", path);
+	rc = luaL_loadbuffer(self->LuaState, buf+skip, len-skip,
+			     lua_tostring(self->LuaState, -1));
+	lua_remove(self->LuaState, -2);
+#ifdef HAVE_MMAP
+	if (map)
+		munmap(map, len);
+#endif
+	PyMem_Free(copy);
+	if (rc != 0) {
+		PyErr_Format(PyExc_RuntimeError,
+			     "error loading code: %s",
+			     lua_tostring(self->LuaState, -1));
+		lua_settop(self->LuaState, top);
+		return -1;
+	}
+	return 0;
+}
+
+PyObject *LuaState_load_file(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	int top = lua_gettop(self->LuaState);
+	PyObject *ret;
+	char *path;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
+		return NULL;
+	if (LuaState_loadfile(self, path) == -1)
+		return NULL;
+	ret = LuaConvert(self, -1);
+	lua_settop(self->LuaState, top);
+	return ret;
+}
+
+PyObject *LuaState_execute_file(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	int top = lua_gettop(self->LuaState);
+	PyObject *ret = NULL;
+	char *path;
+
+	if (!PyArg_ParseTuple(args, "s", &path))
+		return NULL;
+	if (LuaState_loadfile(self, path) == -1)
+		return NULL;
+
+	if (lua_pcall(self->LuaState, 0, 1, 0) != 0) {
+		LuaState_seterror(self, PyExc_RuntimeError,
+				  "error executing code");
+		goto error;
+	}
+
+	ret = LuaConvert(self, -1);
+  error:
+	lua_settop(self->LuaState, top);
+	return ret;
+}
+
+/* lua_Reader state for load_stream() */
+typedef struct {
+	PyObject *read;
+	PyObject *chunk;
+	Py_ssize_t size;
+	int error;
+} LuaStreamReader;
+
+static const char *py_stream_reader(lua_State *L, void *ud, size_t *size)
+{
+	LuaStreamReader *r = (LuaStreamReader *)ud;
+	char *s;
+	Py_ssize_t len;
+
+	/* The previous chunk is not needed by Lua anymore. */
+	Py_CLEAR(r->chunk);
+	*size = 0;
+	if (r->error)
+		return NULL;
+
+	r->chunk = PyObject_CallFunction(r->read, "n", r->size);
+	if (!r->chunk) {
+		r->error = 1;
+		return NULL;
+	}
+	if (PyString_AsStringAndSize(r->chunk, &s, &len) == -1) {
+		r->error = 1;
+		return NULL;
+	}
+	*size = len;
+	return len ? s : NULL;
+}
+
+PyObject *LuaState_load_stream(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	int top = lua_gettop(self->LuaState);
+	LuaStreamReader r;
+	PyObject *file, *ret = NULL;
+	char *name = "=<stream>";
+	int rc;
+
+	r.size = 65536;
+	if (!PyArg_ParseTuple(args, "O|sn", &file, &name, &r.size))
+		return NULL;
+	if (r.size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "chunk size must be positive");
+		return NULL;
+	}
+	r.read = PyObject_GetAttrString(file, "read");
+	if (!r.read)
+		return NULL;
+	r.chunk = NULL;
+	r.error = 0;
+
+	rc = lua_load(self->LuaState, py_stream_reader, &r, name);
+	Py_XDECREF(r.chunk);
+	Py_DECREF(r.read);
+
+	if (r.error) {
+		/* Python exception from read() is already set. */
+	} else if (rc != 0) {
+		PyErr_Format(PyExc_RuntimeError,
+			     "error loading code: %s",
+			     lua_tostring(self->LuaState, -1));
+	} else {
+		ret = LuaConvert(self, -1);
+	}
+	lua_settop(self->LuaState, top);
+	return ret;
+}
+
+PyObject *LuaState_globals(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	int top = lua_gettop(self->LuaState);
+	PyObject *ret = NULL;
+	lua_pushvalue(self->LuaState, LUA_GLOBALSINDEX);
+	if (lua_isnil(self->LuaState, -1)) {
+		PyErr_SetString(PyExc_RuntimeError,
+				"lost globals reference");
+		lua_pop(self->LuaState, 1);
+		return NULL;
+	}
+	ret = LuaConvert(self, -1);
+	if (!ret)
+		PyErr_Format(PyExc_TypeError,
+			     "failed to convert globals table");
+	lua_settop(self->LuaState, top);
+	return ret;
+}
+
+static PyObject *LuaState_require(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	lua_pushliteral(self->LuaState, "require");
+	lua_rawget(self->LuaState, LUA_GLOBALSINDEX);
+	if (lua_isnil(self->LuaState, -1)) {
+		lua_pop(self->LuaState, 1);
+		PyErr_SetString(PyExc_RuntimeError, "require is not defined");
+		return NULL;
+	}
+	return LuaCall(self, args);
+}
+
+/**
+ * Drop the snapshot python.snapshot() took of the given object, after
+ * changing it from Python, or all snapshots when called without one.
+ */
+static PyObject *LuaState_invalidate(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	PyObject *o = NULL;
+
+	if (!PyArg_ParseTuple(args, "|O", &o))
+		return NULL;
+	py_snapshot_invalidate(self->LuaState, o);
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+/**
+ * Create a sink that Lua code writes to with out:write(...). The output
+ * is accumulated in C and read back with getvalue() or through the
+ * buffer protocol.
+ */
+static PyObject *LuaState_capture(PyObject *pself, PyObject *args)
+{
+	return PyObject_CallObject((PyObject *)&LuaSinkObjectType, NULL);
+}
+
+/**
+ * Set t[key] = value for the table at 't' from Python objects, and the
+ * same in the table at 'shadow' unless it's 0.
+ */
+static int LuaState_rawset(LuaStateObject *self, int t, int shadow,
+			   PyObject *key, PyObject *value)
+{
+	lua_State *L = self->LuaState;
+	lua_Number n;
+
+	if (!e_py_convert(self, key, 0))
+		return -1;
+	n = lua_tonumber(L, -1);
+	if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && n != n)) {
+		PyErr_SetString(PyExc_ValueError, "invalid table key");
+		return -1;
+	}
+	if (!e_py_convert(self, value, 0))
+		return -1;
+	if (shadow) {
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, shadow);
+	}
+	lua_rawset(L, t);
+	return 0;
+}
+
+/**
+ * new_table(narr=0, nrec=0, init=None) - create a table with room for
+ * 'narr' array and 'nrec' hash items, filled from the sequence or
+ * mapping 'init'. Without sizes, they are taken from 'init'.
+ */
+static PyObject *LuaState_new_table(PyObject *pself, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"narr", "nrec", "init", NULL};
+	LuaStateObject *self = (LuaStateObject *)pself;
+	lua_State *L = self->LuaState;
+	PyObject *init = Py_None, *items = NULL, *key, *value, *ret = NULL;
+	int narr = 0, nrec = 0;
+	int t = lua_gettop(L) + 1;
+	Py_ssize_t i, n;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiO", kwlist,
+					 &narr, &nrec, &init))
+		return NULL;
+	if (narr < 0 || nrec < 0) {
+		PyErr_SetString(PyExc_ValueError, "sizes must not be negative");
+		return NULL;
+	}
+
+	if (init == Py_None) {
+		lua_createtable(L, narr, nrec);
+	} else if (PyDict_Check(init)) {
+		if (!nrec)
+			nrec = (int)PyDict_Size(init);
+		lua_createtable(L, narr, nrec);
+		i = 0;
+		while (PyDict_Next(init, &i, &key, &value))
+			if (LuaState_rawset(self, t, 0, key, value) == -1)
+				goto error;
+	} else if (PyMapping_Check(init) && PyObject_HasAttrString(init, "items")) {
+		/* Python classes with __getitem__ pass both checks, so tell
+		 * mappings by their items() */
+		value = PyMapping_Items(init);
+		if (!value)
+			goto error;
+		/* items() may return any iterable */
+		items = PySequence_Fast(value, "items() must return a sequence");
+		Py_DECREF(value);
+		if (!items)
+			goto error;
+		n = PySequence_Fast_GET_SIZE(items);
+		lua_createtable(L, narr, nrec ? nrec : (int)n);
+		for (i = 0; i != n; i++) {
+			PyObject *item = PySequence_Fast_GET_ITEM(items, i);
+			if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+				PyErr_SetString(PyExc_TypeError,
+						"items() must return (key, value) pairs");
+				goto error;
+			}
+			if (LuaState_rawset(self, t, 0, PyTuple_GET_ITEM(item, 0),
+					    PyTuple_GET_ITEM(item, 1)) == -1)
+				goto error;
+		}
+	} else {
+		items = PySequence_Fast(init, "init must be a sequence or mapping");
+		if (!items)
+			goto error;
+		n = PySequence_Fast_GET_SIZE(items);
+		lua_createtable(L, narr ? narr : (int)n, nrec);
+		for (i = 0; i != n; i++) {
+			if (!e_py_convert(self, PySequence_Fast_GET_ITEM(items, i), 0))
+				goto error;
+			lua_rawseti(L, t, (int)i+1);
+		}
+	}
+
+	ret = LuaConvert(self, t);
+  error:
+	Py_XDECREF(items);
+	lua_settop(L, t - 1);
+	return ret;
+}
+
+/**
+ * session() - context manager for a batch of operations. Values they
+ * produce are kept on the Lua stack instead of the registry, and are
+ * all released when the block exits.
+ */
+static PyObject *LuaState_session(PyObject *pself, PyObject *args)
+{
+	LuaSessionObject *session = PyObject_New(LuaSessionObject,
+						 &LuaSessionObjectType);
+	if (session) {
+		Py_INCREF(pself);
+		session->state = (LuaStateObject *)pself;
+		session->outer = NULL;
+		session->base = 0;
+		session->active = 0;
+		session->generation = 0;
+	}
+	return (PyObject *)session;
+}
+
+/**
+ * record_type(fields) - accessor for tables with the given string
+ * fields. The key strings are created once and kept in a table, so
+ * accesses push them without converting or hashing.
+ */
+static PyObject *LuaState_record_type(PyObject *pself, PyObject *fields)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	lua_State *L = self->LuaState;
+	LuaRecordTypeObject *rt;
+	PyObject *names, *i;
+	Py_ssize_t n, k;
+
+	names = PySequence_Tuple(fields);
+	if (!names)
+		return NULL;
+	n = PyTuple_GET_SIZE(names);
+	rt = PyObject_New(LuaRecordTypeObject, &LuaRecordTypeObjectType);
+	if (!rt) {
+		Py_DECREF(names);
+		return NULL;
+	}
+	Py_INCREF(self);
+	rt->state = self;
+	rt->fields = names;
+	rt->nfields = n;
+	rt->keys = LUA_NOREF;
+	rt->index = PyDict_New();
+	if (!rt->index) {
+		Py_DECREF(rt);
+		return NULL;
+	}
+
+	lua_createtable(L, (int)n, 0);
+	for (k = 0; k != n; k++) {
+		PyObject *name = PyTuple_GET_ITEM(names, k);
+		if (!PyString_Check(name)) {
+			PyErr_SetString(PyExc_TypeError,
+					"field names must be strings");
+			goto error;
+		}
+		i = PyInt_FromSsize_t(k+1);
+		if (!i || PyDict_SetItem(rt->index, name, i) == -1) {
+			Py_XDECREF(i);
+			goto error;
+		}
+		Py_DECREF(i);
+		lua_pushlstring(L, PyString_AS_STRING(name),
+				PyString_GET_SIZE(name));
+		lua_rawseti(L, -2, (int)k+1);
+	}
+	rt->keys = luaL_ref(L, LUA_REGISTRYINDEX);
+	return (PyObject *)rt;
+  error:
+	lua_pop(L, 1);
+	Py_DECREF(rt);
+	return NULL;
+}
+
+/**
+ * freeze(table) - make a read-only copy of 'table' and return it as an
+ * immutable mapping. Lua sees the mapping as the frozen table, and the
+ * frozen table converts back to the same mapping, which is built once.
+ */
+static PyObject *LuaState_freeze(PyObject *pself, PyObject *table)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	lua_State *L = self->LuaState;
+	int top = lua_gettop(L);
+	PyObject *ret = NULL;
+
+	lua_pushcfunction(L, py_freeze);
+	if (!e_py_convert(self, table, 0))
+		goto error;
+	if (lua_pcall(L, 1, 1, 0) != 0) {
+		LuaState_seterror(self, PyExc_TypeError, "error freezing table");
+		goto error;
+	}
+	ret = LuaFrozen_New(self, -1);
+  error:
+	lua_settop(L, top);
+	return ret;
+}
+
+/* Replace each key from index 2 on with table[key], table at 1. */
+static int LuaState_gettables(lua_State *L)
+{
+	int i, n = lua_gettop(L);
+	for (i = 2; i <= n; i++) {
+		lua_pushvalue(L, i);
+		lua_gettable(L, 1);
+		lua_replace(L, i);
+	}
+	return n - 1;
+}
+
+/**
+ * getmany(table, keys) - the values of several keys of a table, as a
+ * tuple, looked up in a single protected call.
+ */
+static PyObject *LuaState_getmany(PyObject *pself, PyObject *args)
+{
+	LuaStateObject *self = (LuaStateObject *)pself;
+	lua_State *L = self->LuaState;
+	int top = lua_gettop(L);
+	PyObject *table, *keys, *seq, *ret = NULL;
+	Py_ssize_t i, n;
+	int base;
+
+	if (!PyArg_ParseTuple(args, "OO", &table, &keys))
+		return NULL;
+	seq = PySequence_Fast(keys, "keys must be a sequence");
+	if (!seq)
+		return NULL;
+	n = PySequence_Fast_GET_SIZE(seq);
+	if (n >= INT_MAX || !lua_checkstack(L, (int)n + 2)) {
+		PyErr_SetString(PyExc_ValueError, "too many keys");
+		goto error;
+	}
+
+	lua_pushcfunction(L, LuaState_gettables);
+	base = lua_gettop(L);
+	if (!e_py_convert(self, table, 0))
+		goto error;
+	for (i = 0; i != n; i++)
+		if (!e_py_convert(self, PySequence_Fast_GET_ITEM(seq, i), 0))
+			goto error;
+	if (lua_pcall(L, (int)n + 1, (int)n, 0) != 0) {
+		LuaState_seterror(self, PyExc_Exception, "error");
+		goto error;
+	}
+
+	ret = PyTuple_New(n);
+	for (i = 0; ret && i != n; i++) {
+		PyObject *value = LuaConvert(self, base + (int)i);
+		if (!value) {
+			Py_CLEAR(ret);
+			break;
+		}
+		PyTuple_SET_ITEM(ret, i, value);
+	}
+  error:
+	Py_DECREF(seq);
+	lua_settop(L, top);
+	return ret;
+}
+
+/* Push the sync shadows of the table at 't': the Python dict last
+ * synced into it, then the Lua values that were written. */
+static int LuaState_syncshadows(LuaStateObject *self, int t)
+{
+	lua_State *L = self->LuaState;
+	PyObject *shadow;
+	int created = 0;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_SYNCS);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUA_SYNCS);
+	}
+	lua_pushvalue(L, t);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		shadow = PyDict_New();
+		if (!shadow)
+			return -1;
+		lua_createtable(L, 2, 0);
+		if (!e_py_convert(self, shadow, 0)) {
+			Py_DECREF(shadow);
+			return -1;
+		}
+		Py_DECREF(shadow);
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+		lua_pushvalue(L, t);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+		created = 1;
+	}
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, -2, 2);
+	lua_remove(L, -3);
+	lua_remove(L, -3);
+	return created;
+}
+
+/* Report keys of the table at 't' that Lua changed since they were
+ * written, as found in 'shadow', into 'changes'. */
+static int LuaState_syncjournal(LuaStateObject *self, int t, int shadow,
+				PyObject *changes)
+{
+	lua_State *L = self->LuaState;
+	PyObject *key, *value;
+	int rc, changed;
+
+	lua_pushnil(L);
+	while (lua_next(L, t)) {
+		lua_pushvalue(L, -2);
+		lua_rawget(L, shadow);
+		changed = !lua_rawequal(L, -1, -2);
+		lua_pop(L, 1);
+		if (changed) {
+			key = LuaConvert(self, -2);
+			value = key ? LuaConvert(self, -1) : NULL;
+			rc = value ? PyDict_SetItem(changes, key, value) : -1;
+			Py_XDECREF(key);
+			Py_XDECREF(value);
+			if (rc == -1)
+				return -1;
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, shadow);
+		} else {
+			lua_pop(L, 1);
+		}
+	}
+
+	/* Removed keys; clearing fields is allowed while traversing */
+	lua_pushnil(L);
+	while (lua_next(L, shadow)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, t);
+		changed = lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if (changed) {
+			key = LuaConvert(self, -1);
+			rc = key ? PyDict_SetItem(changes, key, Py_None) : -1;
+			Py_XDECREF(key);
+			if (rc == -1)
+				return -1;
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, shadow);
+		}
+	}
+	return 0;
+}
+
+/**
+ * sync(table, dict, journal=False) - mirror 'dict' into the Lua table,
+ * writing only what changed since the last sync of that table: keys
+ * whose value isn't the same object as before, and removed keys. The
+ * first sync replaces the whole contents. With 'journal', the keys Lua
+ * changed since the last sync are first returned as a dict, with None
+ * for removed keys; Lua's changes stand unless the dict changed them.
+ * Keys must be byte strings, numbers or booleans.
+ */
+static PyObject *LuaState_sync(PyObject *pself, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"table", "dict", "journal", NULL};
+	LuaStateObject *self = (LuaStateObject *)pself;
+	lua_State *L = self->LuaState;
+	int top = lua_gettop(L);
+	int t = top + 1, pyshadow = top + 2, shadow = top + 3;
+	int journal = 0, first;
+	PyObject *table, *dict, *shadowdict, *key, *value, *old;
+	PyObject *changes = NULL, *ret = NULL;
+	Py_ssize_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO!|i:sync", kwlist,
+					 &table, &PyDict_Type, &dict, &journal))
+		return NULL;
+	if (!e_py_convert(self, table, 0))
+		goto error;
+	if (!lua_istable(L, t)) {
+		PyErr_SetString(PyExc_TypeError, "Lua object is not a table");
+		goto error;
+	}
+	/* Other keys would become a new userdata each time, so they
+	 * couldn't be found again to update or remove */
+	i = 0;
+	while (PyDict_Next(dict, &i, &key, &value)) {
+		if (!PyString_Check(key) && !PyInt_Check(key) &&
+		    !PyLong_Check(key) && !PyFloat_Check(key)) {
+			PyErr_Format(PyExc_TypeError,
+				     "can't sync key of type '%.200s'",
+				     key->ob_type->tp_name);
+			goto error;
+		}
+	}
+	first = LuaState_syncshadows(self, t);
+	if (first == -1)
+		goto error;
+	shadowdict = check_py_object(L, pyshadow)->o;
+
+	if (journal) {
+		changes = PyDict_New();
+		if (!changes ||
+		    (!first && LuaState_syncjournal(self, t, shadow, changes) == -1))
+			goto fail;
+	}
+
+	if (first) {
+		lua_pushnil(L);
+		while (lua_next(L, t)) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, t);
+		}
+	}
+
+	i = 0;
+	while (PyDict_Next(dict, &i, &key, &value)) {
+		old = PyDict_GetItem(shadowdict, key);
+		if (old == value)
+			continue;
+		if (LuaState_rawset(self, t, shadow, key, value) == -1)
+			goto fail;
+		lua_settop(L, shadow);
+	}
+	i = 0;
+	while (PyDict_Next(shadowdict, &i, &key, &value)) {
+		if (PyDict_Contains(dict, key))
+			continue;
+		if (!e_py_convert(self, key, 0))
+			goto fail;
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, shadow);
+		lua_pushnil(L);
+		lua_rawset(L, t);
+	}
+
+	PyDict_Clear(shadowdict);
+	if (PyDict_Update(shadowdict, dict) == -1)
+		goto fail;
+
+	if (changes) {
+		ret = changes;
+		changes = NULL;
+	} else {
+		Py_INCREF(Py_None);
+		ret = Py_None;
+	}
+	goto error;
+
+  fail:
+	/* Forget the shadows, so the next sync starts over */
+	lua_settop(L, t);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_SYNCS);
+	lua_pushvalue(L, t);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+  error:
+	Py_XDECREF(changes);
+	lua_settop(L, top);
+	return ret;
+}
+
+/* Buffers and compiled expression for eval_columns */
+typedef struct {
+	const char *source;
+	size_t sourcelen;
+	int ncols;
+	Py_buffer *views;	/* ncols columns, then out */
+	char *fmts;
+	Py_ssize_t *itemsizes;
+	Py_ssize_t rows;
+	int refresh;		/* some buffers are old style */
+} LuaColumns;
+
+/* Old style buffers can be resized by the expression: get their memory
+ * again, and make sure it still holds all rows. */
+static void LuaColumns_refresh(lua_State *L, LuaColumns *c, Py_ssize_t row)
+{
+	int j;
+
+	for (j = 0; j <= c->ncols; j++) {
+		if (py_buffer_refresh(&c->views[j]) == -1) {
+			PyErr_Clear();
+			luaL_error(L, "row %d: failed to get buffer", (int)row + 1);
+		}
+		if (c->views[j].len < c->rows * c->itemsizes[j])
+			luaL_error(L, "row %d: buffer was resized", (int)row + 1);
+	}
+}
+
+/* Compile the expression, then run it row by row from C. */
+static int LuaColumns_run(lua_State *L)
+{
+	LuaColumns *c = (LuaColumns *)lua_touserdata(L, 1);
+	Py_buffer *out = &c->views[c->ncols];
+	char outfmt = c->fmts[c->ncols];
+	Py_ssize_t outsize = c->itemsizes[c->ncols];
+	Py_ssize_t i;
+	int j, fn;
+
+	if (luaL_loadbuffer(L, c->source, c->sourcelen, "=eval_columns") != 0)
+		lua_error(L);
+	lua_call(L, 0, 1);
+	fn = lua_gettop(L);
+	luaL_checkstack(L, c->ncols + 1, "too many columns");
+
+	for (i = 0; i != c->rows; i++) {
+		if (c->refresh)
+			LuaColumns_refresh(L, c, i);
+		lua_pushvalue(L, fn);
+		for (j = 0; j != c->ncols; j++)
+			py_view_push(L, c->fmts[j], (char *)c->views[j].buf +
+						    i*c->itemsizes[j]);
+		lua_call(L, c->ncols, 1);
+		if (!lua_isnumber(L, -1))
+			return luaL_error(L, "row %d: expression result is not a number",
+					  (int)i + 1);
+		if (c->refresh)
+			LuaColumns_refresh(L, c, i);
+		if (py_view_store(outfmt, (char *)out->buf + i*outsize,
+				  lua_tonumber(L, -1)) == -1)
+			return luaL_error(L, "row %d: result out of range for out",
+					  (int)i + 1);
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+/* Element format of a column: the buffer's own format, else for old
+ * style buffers an array's typecode, else doubles. 0 if unsupported. */
+static char LuaColumns_format(PyObject *o, Py_buffer *view)
+{
+	const char *format = view->format;
+	PyObject *typecode;
+	char fmt = 'd';
+
+	if (format) {
+		if (*format == '@')
+			format++;
+		return format[0] && !format[1] ? format[0] : 0;
+	}
+	if (PyObject_CheckBuffer(o))
+		return 'B';
+	typecode = PyObject_GetAttrString(o, "typecode");
+	if (typecode) {
+		if (PyString_Check(typecode) && PyString_GET_SIZE(typecode) == 1)
+			fmt = PyString_AS_STRING(typecode)[0];
+		Py_DECREF(typecode);
+	} else {
+		PyErr_Clear();
+	}
+	return fmt;
+}
+
+/* Get the buffer of column 'o' into slot 'j' of 'c'. Columns must have
+ * c->rows items; out, which comes first, sets it. */
+static int LuaColumns_add(LuaColumns *c, int j, const char *name, PyObject *o,
+			  int writable)
+{
+	Py_buffer *view = &c->views[j];
+	Py_ssize_t itemsize;
+	char fmt;
+
+	if (py_getbuffer(o, view, writable) == -1)
+		return -1;
+	fmt = LuaColumns_format(o, view);
+	itemsize = fmt ? py_view_itemsize(fmt) : 0;
+	if (!itemsize) {
+		if (view->format)
+			PyErr_Format(PyExc_ValueError, "%s: unsupported format '%s'",
+				     name, view->format);
+		else
+			PyErr_Format(PyExc_ValueError, "%s: unsupported format '%c'",
+				     name, fmt);
+		goto error;
+	}
+	if (writable && view->readonly) {
+		PyErr_Format(PyExc_TypeError, "%s is read-only", name);
+		goto error;
+	}
+	if (view->len % itemsize != 0) {
+		PyErr_Format(PyExc_ValueError,
+			     "%s: size is not a multiple of %zd bytes",
+			     name, itemsize);
+		goto error;
+	}
+	if (writable) {
+		c->rows = view->len / itemsize;
+	} else if (view->len / itemsize != c->rows) {
+		PyErr_Format(PyExc_ValueError, "%s: expected %zd items",
+			     name, c->rows);
+		goto error;
+	}
+	if (!PyObject_CheckBuffer(o))
+		c->refresh = 1;
+	c->fmts[j] = fmt;
+	c->itemsizes[j] = itemsize;
+	return 0;
+  error:
+	PyBuffer_Release(view);
+	return -1;
+}
+
+/* Lua identifiers only, as the names become parameters of the chunk */
+static int LuaColumns_checkname(PyObject *name)
+{
+	const char *s;
+
+	if (!PyString_Check(name) || PyString_GET_SIZE(name) == 0)
+		goto error;
+	s = PyString_AS_STRING(name);
+	if (isdigit((unsigned char)*s))
+		goto error;
+	for (; *s; s++)
+		if (!isalnum((unsigned char)*s) && *s != '_')
+			goto error;
+	return 0;
+  error:
+	PyErr_SetString(PyExc_ValueError, "column names must be identifiers");
+	return -1;
+}
+
+/**
+ * eval_columns(expr, columns, out) - evaluate the Lua expression 'expr'
+ * once per row, with the names in the dict 'columns' bound to that
+ * row's values from their buffers, storing the results in 'out'.
+ * Items are read by the buffer's format, or for old style buffers by
+ * their typecode (array.array), else as doubles. The expression is
+ * compiled once and the loop runs in C, so rows cost a Lua call each
+ * and no Python objects. Returns 'out'.
+ */
+static PyObject *LuaState_eval_columns(PyObject *pself, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = {"expr", "columns", "out", NULL};
+	LuaStateObject *self = (LuaStateObject *)pself;
+	lua_State *L = self->LuaState;
+	PyObject *expr, *columns, *out, *name, *o, *ret = NULL;
+	PyObject *names = NULL, *sep = NULL, *params = NULL, *source = NULL;
+	LuaColumns c;
+	Py_ssize_t i;
+	int j, got = 0, gotout = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "SO!O:eval_columns", kwlist,
+					 &expr, &PyDict_Type, &columns, &out))
+		return NULL;
+
+	c.ncols = (int)PyDict_Size(columns);
+	c.refresh = 0;
+	c.views = PyMem_New(Py_buffer, c.ncols + 1);
+	c.fmts = PyMem_New(char, c.ncols + 1);
+	c.itemsizes = PyMem_New(Py_ssize_t, c.ncols + 1);
+	names = PyList_New(0);
+	if (!c.views || !c.fmts || !c.itemsizes) {
+		PyErr_NoMemory();
+		goto error;
+	}
+	if (!names || LuaColumns_add(&c, c.ncols, "out", out, 1) == -1)
+		goto error;
+	gotout = 1;
+
+	i = 0;
+	while (PyDict_Next(columns, &i, &name, &o)) {
+		if (LuaColumns_checkname(name) == -1 ||
+		    PyList_Append(names, name) == -1 ||
+		    LuaColumns_add(&c, got, PyString_AS_STRING(name), o, 0) == -1)
+			goto error;
+		got++;
+	}
+
+	sep = PyString_FromString(", ");
+	params = sep ? _PyString_Join(sep, names) : NULL;
+	if (!params)
+		goto error;
+	source = PyString_FromFormat("return function(%s) return (%s) end",
+				     PyString_AS_STRING(params),
+				     PyString_AS_STRING(expr));
+	if (!source)
+		goto error;
+	c.source = PyString_AS_STRING(source);
+	c.sourcelen = PyString_GET_SIZE(source);
+
+	if (lua_cpcall(L, LuaColumns_run, &c) != 0) {
+		LuaState_seterror(self, PyExc_RuntimeError,
+				  "error evaluating columns");
+		lua_pop(L, 1);
+		goto error;
+	}
+	Py_INCREF(out);
+	ret = out;
+
+  error:
+	for (j = 0; j != got; j++)
+		PyBuffer_Release(&c.views[j]);
+	if (gotout)
+		PyBuffer_Release(&c.views[c.ncols]);
+	PyMem_Free(c.views);
+	PyMem_Free(c.fmts);
+	PyMem_Free(c.itemsizes);
+	Py_XDECREF(names);
+	Py_XDECREF(sep);
+	Py_XDECREF(params);
+	Py_XDECREF(source);
+	return ret;
+}
+
+static PyMethodDef luastate_methods[] = {
+	{"execute",	LuaState_execute,	METH_VARARGS,		NULL},
+	{"eval",	LuaState_eval,		METH_VARARGS,		NULL},
+	{"globals",	LuaState_globals,	METH_NOARGS,		NULL},
+	{"require", 	LuaState_require,	METH_VARARGS,		NULL},
+	{"execute_file", LuaState_execute_file,	METH_VARARGS,		NULL},
+	{"load_file",	LuaState_load_file,	METH_VARARGS,		NULL},
+	{"load_stream",	LuaState_load_stream,	METH_VARARGS,		NULL},
+	{"capture",	LuaState_capture,	METH_NOARGS,		NULL},
+	{"invalidate",	LuaState_invalidate,	METH_VARARGS,		NULL},
+	{"new_table",	(PyCFunction)LuaState_new_table, METH_VARARGS | METH_KEYWORDS, NULL},
+	{"session",	LuaState_session,	METH_NOARGS,		NULL},
+	{"record_type",	LuaState_record_type,	METH_O,			NULL},
+	{"freeze",	LuaState_freeze,	METH_O,			NULL},
+	{"getmany",	LuaState_getmany,	METH_VARARGS,		NULL},
+	{"sync",	(PyCFunction)LuaState_sync, METH_VARARGS | METH_KEYWORDS, NULL},
+	{"eval_columns", (PyCFunction)LuaState_eval_columns, METH_VARARGS | METH_KEYWORDS, NULL},
+	{NULL,		NULL,			0,			NULL}
+};
+
+/* Python type object to hold LuaState */
+PyTypeObject LuaStateObjectType = {
+	PyObject_HEAD_INIT(NULL)
+	0,			/*ob_size*/
+	"lua.LuaState",		/*tp_name*/
+	sizeof(LuaStateObject),	/*tp_basicsize*/
+	0,			/*tp_itemsize*/
+	(destructor)LuaStateObject_dealloc, /*tp_dealloc*/
+	0,			/*tp_print*/
+	0,			/*tp_getattr*/
+	0,			/*tp_setattr*/
+	0,			/*tp_compare*/
+	LuaStateObject_str,	/*tp_repr*/
+	0,			/*tp_as_number*/
+	0,			/*tp_as_sequence*/
+	0,			/*tp_as_mapping*/
+	0,			/*tp_hash*/
+	0,	     		/*tp_call*/
+	LuaStateObject_str,	/*tp_str*/
+	0,			/*tp_getattro*/
+	0,			/*tp_setattro*/
+	0,			/*tp_as_buffer*/
+	Py_TPFLAGS_DEFAULT, 	/*tp_flags*/
+	"Lua state object",	/*tp_doc*/
+	0,			/*tp_traverse*/
+	0,			/*tp_clear*/
+	0,			/*tp_richcompare*/
+	0,			/*tp_weaklistoffset*/
+	0,			/*tp_iter*/
+	0, 			/*tp_iternext*/
+	luastate_methods,      	/*tp_methods*/
+	0,       		/*tp_members*/
+	0,                      /*tp_getset*/
+	0,                      /*tp_base*/
+	0,                      /*tp_dict*/
+	0,                      /*tp_descr_get*/
+	0,                      /*tp_descr_set*/
+	0,                      /*tp_dictoffset*/
+	(initproc)LuaStateObject_init,	/*tp_init*/
+	0,			/*tp_alloc*/
+	0,			/*tp_new*/
+	0,			/*tp_free*/
+	0,                      /*tp_is_gc*/
+};
+
+/*********************************************************************************
+ * C API
+ ********************************************************************************/
+
+static LuaStateObject *LuaCAPI_state(PyObject *state)
+{
+	if (!PyObject_TypeCheck(state, &LuaStateObjectType)) {
+		PyErr_SetString(PyExc_TypeError, "LuaState expected");
+		return NULL;
+	}
+	return (LuaStateObject *)state;
+}
+
+static lua_State *LuaCAPI_get_state(PyObject *state)
+{
+	LuaStateObject *self = LuaCAPI_state(state);
+	return self ? self->LuaState : NULL;
+}
+
+static PyObject *LuaCAPI_global_state(void)
+{
+	return (PyObject *)GetGlobalLuaState();
+}
+
+static PyObject *LuaCAPI_to_py(PyObject *state, int n)
+{
+	LuaStateObject *self = LuaCAPI_state(state);
+	return self ? LuaConvert(self, n) : NULL;
+}
+
+static PyObject *LuaCAPI_wrap(PyObject *state, int n)
+{
+	LuaStateObject *self = LuaCAPI_state(state);
+	return self ? LuaObject_New(self, n) : NULL;
+}
+
+static int LuaCAPI_push(PyObject *state, PyObject *o)
+{
+	LuaStateObject *self = LuaCAPI_state(state);
+	return self ? e_py_convert(self, o, 0) : 0;
+}
+
+static LuaCAPI LuaCAPI_api = {
+	LUA_CAPI_VERSION,
+	LuaCAPI_get_state,
+	LuaCAPI_global_state,
+	LuaCAPI_to_py,
+	LuaCAPI_wrap,
+	LuaCAPI_push,
+	py_convert,
+	PyGILState_Ensure,
+	PyGILState_Release,
+	NULL,
+};
+
+/*********************************************************************************
+ * Module
+ ********************************************************************************/
+
+/**
+ * Proxy execute call to module global state.
+ */
+PyObject *Lua_execute(PyObject *self, PyObject *args)
+{
+	return LuaState_execute((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy eval call to module global state.
+ */
+PyObject *Lua_eval(PyObject *self, PyObject *args)
+{
+	return LuaState_eval((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy globals call to module global state.
+ */
+PyObject *Lua_globals(PyObject *self, PyObject *args)
+{
+	return LuaState_globals((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
  * Proxy require call to module global state.
  */
 static PyObject *Lua_require(PyObject *self, PyObject *args)
@@ -716,13 +3704,109 @@ static PyObject *Lua_require(PyObject *self, PyObject *args)
 	return LuaState_require((PyObject *)GetGlobalLuaState(), args);
 }
 
+/**
+ * Proxy execute_file call to module global state.
+ */
+static PyObject *Lua_execute_file(PyObject *self, PyObject *args)
+{
+	return LuaState_execute_file((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy load_file call to module global state.
+ */
+static PyObject *Lua_load_file(PyObject *self, PyObject *args)
+{
+	return LuaState_load_file((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy load_stream call to module global state.
+ */
+static PyObject *Lua_load_stream(PyObject *self, PyObject *args)
+{
+	return LuaState_load_stream((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy getmany call to module global state.
+ */
+static PyObject *Lua_getmany(PyObject *self, PyObject *args)
+{
+	return LuaState_getmany((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy invalidate call to module global state.
+ */
+static PyObject *Lua_invalidate(PyObject *self, PyObject *args)
+{
+	return LuaState_invalidate((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy capture call to module global state.
+ */
+static PyObject *Lua_capture(PyObject *self, PyObject *args)
+{
+	return LuaState_capture((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy new_table call to module global state.
+ */
+static PyObject *Lua_new_table(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	return LuaState_new_table((PyObject *)GetGlobalLuaState(), args, kwds);
+}
+
+/**
+ * Proxy session call to module global state.
+ */
+static PyObject *Lua_session(PyObject *self, PyObject *args)
+{
+	return LuaState_session((PyObject *)GetGlobalLuaState(), args);
+}
+
+/**
+ * Proxy record_type call to module global state.
+ */
+static PyObject *Lua_record_type(PyObject *self, PyObject *fields)
+{
+	return LuaState_record_type((PyObject *)GetGlobalLuaState(), fields);
+}
+
+/**
+ * Proxy freeze call to module global state.
+ */
+static PyObject *Lua_freeze(PyObject *self, PyObject *table)
+{
+	return LuaState_freeze((PyObject *)GetGlobalLuaState(), table);
+}
+
+/**
+ * Proxy sync call to module global state.
+ */
+static PyObject *Lua_sync(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	return LuaState_sync((PyObject *)GetGlobalLuaState(), args, kwds);
+}
+
+/**
+ * Proxy eval_columns call to module global state.
+ */
+static PyObject *Lua_eval_columns(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	return LuaState_eval_columns((PyObject *)GetGlobalLuaState(), args, kwds);
+}
+
 /**
  * Create a new LuaState which can have its own global variables
  * independently of the module-wide state.
  */
-static PyObject *Lua_new_state(PyObject *self, PyObject *args)
+static PyObject *Lua_new_state(PyObject *self, PyObject *args, PyObject *kwds)
 {
-	return PyObject_CallObject((PyObject *)&LuaStateObjectType, NULL);
+	return PyObject_Call((PyObject *)&LuaStateObjectType, args, kwds);
 }
 
 static PyMethodDef lua_methods[] = {
@@ -730,14 +3814,32 @@ static PyMethodDef lua_methods[] = {
 	{"eval",	Lua_eval,	METH_VARARGS,		NULL},
 	{"globals",	Lua_globals,	METH_NOARGS,		NULL},
 	{"require", 	Lua_require,	METH_VARARGS,		NULL},
-	{"new_state",	Lua_new_state,	METH_NOARGS,		NULL},
+	{"execute_file", Lua_execute_file, METH_VARARGS,		NULL},
+	{"load_file",	Lua_load_file,	METH_VARARGS,		NULL},
+	{"load_stream",	Lua_load_stream, METH_VARARGS,		NULL},
+	{"capture",	Lua_capture,	METH_NOARGS,		NULL},
+	{"invalidate",	Lua_invalidate,	METH_VARARGS,		NULL},
+	{"new_table",	(PyCFunction)Lua_new_table, METH_VARARGS | METH_KEYWORDS, NULL},
+	{"session",	Lua_session,	METH_NOARGS,		NULL},
+	{"record_type",	Lua_record_type, METH_O,		NULL},
+	{"freeze",	Lua_freeze,	METH_O,			NULL},
+	{"getmany",	Lua_getmany,	METH_VARARGS,		NULL},
+	{"sync",	(PyCFunction)Lua_sync,	METH_VARARGS | METH_KEYWORDS, NULL},
+	{"eval_columns", (PyCFunction)Lua_eval_columns, METH_VARARGS | METH_KEYWORDS, NULL},
+	{"new_state",	(PyCFunction)Lua_new_state, METH_VARARGS | METH_KEYWORDS, NULL},
 	{NULL,		NULL,		0,			NULL}
 };
 
+static LuaConverters LuaConverters_api = {
+	LUA_CONVERTERS_VERSION,
+	py_converter_register,
+	LuaConverter_register,
+};
+
 DL_EXPORT(void)
 initlua(void)
 {
-	PyObject *m;
+	PyObject *m, *api;
 
 	LuaObjectType.tp_new = PyType_GenericNew;
 	if (PyType_Ready(&LuaObjectType) < 0)
@@ -747,6 +3849,24 @@ initlua(void)
 	if (PyType_Ready(&LuaStateObjectType) < 0)
 		return;
 
+	LuaSinkObjectType.tp_new = PyType_GenericNew;
+	if (PyType_Ready(&LuaSinkObjectType) < 0)
+		return;
+
+	if (PyType_Ready(&LuaSessionObjectType) < 0 ||
+	    PyType_Ready(&LuaSlotObjectType) < 0)
+		return;
+
+	if (PyType_Ready(&LuaRecordTypeObjectType) < 0 ||
+	    PyType_Ready(&LuaRecordObjectType) < 0)
+		return;
+
+	if (PyType_Ready(&LuaFrozenObjectType) < 0)
+		return;
+
+	if (PyType_Ready(&LuaNumArrayObjectType) < 0)
+		return;
+
 	m = Py_InitModule3("lua", lua_methods,
 			   "Lua as a Python module (with state support).");
 	if (!m)
@@ -756,4 +3876,23 @@ initlua(void)
 	PyModule_AddObject(m, "LuaObject", (PyObject *)&LuaObjectType);
 	Py_INCREF(&LuaStateObjectType);
 	PyModule_AddObject(m, "LuaState", (PyObject *)&LuaStateObjectType);
+	Py_INCREF(&LuaSinkObjectType);
+	PyModule_AddObject(m, "LuaSink", (PyObject *)&LuaSinkObjectType);
+	Py_INCREF(&LuaNumArrayObjectType);
+	PyModule_AddObject(m, "NumArray", (PyObject *)&LuaNumArrayObjectType);
+
+	LuaError = PyErr_NewException("lua.LuaError", PyExc_RuntimeError, NULL);
+	if (!LuaError)
+		return;
+	Py_INCREF(LuaError);
+	PyModule_AddObject(m, "LuaError", LuaError);
+
+	api = PyCapsule_New(&LuaConverters_api, LUA_CONVERTERS_CAPSULE, NULL);
+	if (api)
+		PyModule_AddObject(m, "_converters", api);
+
+	LuaCAPI_api.converters = &LuaConverters_api;
+	api = PyCapsule_New(&LuaCAPI_api, LUA_CAPI_CAPSULE, NULL);
+	if (api)
+		PyModule_AddObject(m, "_C_API", api);
 }
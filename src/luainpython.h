@@ -34,16 +34,128 @@ PyAPI_DATA(PyTypeObject) LuaObjectType;
 
 #define LuaObject_Check(op) PyObject_TypeCheck(op, &LuaObjectType)
 
+/* Python strings made from Lua strings, keyed by Lua string address */
+typedef struct {
+	const char *s;
+	PyObject *o;
+} LuaStringCacheEntry;
+
+/* Lua strings made from interned Python strings, kept as registry refs */
+typedef struct {
+	PyObject *o;
+	int ref;
+} LuaStringRefEntry;
+
 /* Type object to hold Lua state */
 typedef struct {
 	PyObject_HEAD
 	lua_State *LuaState;
+	LuaStringCacheEntry *strcache;
+	LuaStringRefEntry *refcache;
+	PyObject *session;	/* innermost active session, borrowed */
 } LuaStateObject;
 
 PyAPI_DATA(PyTypeObject) LuaStateObjectType;
 
+/* Growable output buffer written from Lua, read from Python */
+typedef struct {
+	PyObject_HEAD
+	char *buf;
+	Py_ssize_t len;
+	Py_ssize_t size;
+	int exports;
+} LuaSinkObject;
+
+PyAPI_DATA(PyTypeObject) LuaSinkObjectType;
+
+#define LuaSink_Check(op) PyObject_TypeCheck(op, &LuaSinkObjectType)
+
+int LuaSink_append(LuaSinkObject *sink, const char *s, size_t len);
+
+/* Fixed-size numeric array, indexed from Lua and a buffer to Python */
+typedef struct {
+	PyObject_HEAD
+	char *data;
+	Py_ssize_t len;
+	Py_ssize_t itemsize;
+	char fmt[2];
+} LuaNumArrayObject;
+
+PyAPI_DATA(PyTypeObject) LuaNumArrayObjectType;
+
+#define LuaNumArray_Check(op) PyObject_TypeCheck(op, &LuaNumArrayObjectType)
+
+PyObject *LuaNumArray_New(Py_ssize_t n, char fmt);
+
+/* Batch of operations keeping their values on the Lua stack */
+typedef struct {
+	PyObject_HEAD
+	LuaStateObject *state;
+	PyObject *outer;	/* session active when entered, borrowed */
+	int base;
+	int active;
+	long generation;
+} LuaSessionObject;
+
+PyAPI_DATA(PyTypeObject) LuaSessionObjectType;
+
+/* Stack slot of a session */
+typedef struct {
+	PyObject_HEAD
+	LuaSessionObject *session;
+	int index;
+	long generation;
+} LuaSlotObject;
+
+PyAPI_DATA(PyTypeObject) LuaSlotObjectType;
+
+#define LuaSlot_Check(op) PyObject_TypeCheck(op, &LuaSlotObjectType)
+#define LuaSlot_valid(slot) \
+	((slot)->session->active && \
+	 (slot)->generation == (slot)->session->generation && \
+	 (slot)->index <= lua_gettop((slot)->session->state->LuaState))
+
+/* Accessor for tables with a fixed set of fields */
+typedef struct {
+	PyObject_HEAD
+	LuaStateObject *state;
+	PyObject *fields;	/* tuple of names */
+	PyObject *index;	/* name -> 1-based position */
+	Py_ssize_t nfields;
+	int keys;		/* ref to the table of key strings */
+} LuaRecordTypeObject;
+
+PyAPI_DATA(PyTypeObject) LuaRecordTypeObjectType;
+
+/* Attribute proxy for one record */
+typedef struct {
+	PyObject_HEAD
+	LuaRecordTypeObject *type;
+	int ref;
+} LuaRecordObject;
+
+PyAPI_DATA(PyTypeObject) LuaRecordObjectType;
+
+/* Immutable mapping built once from a frozen table */
+typedef struct {
+	PyObject_HEAD
+	LuaStateObject *state;
+	int ref;		/* the frozen proxy */
+	PyObject *dict;
+} LuaFrozenObject;
+
+PyAPI_DATA(PyTypeObject) LuaFrozenObjectType;
+
+/* Raised for Lua errors that are neither strings nor Python exceptions */
+PyAPI_DATA(PyObject *) LuaError;
+
+#define LUA_CONVERTERS "PyConverters"
+#define LUA_SYNCS "PySyncShadows"
+
 PyObject *LuaConvert(LuaStateObject *state, int n);
+int LuaConverter_register(const char *tname, LuaToPyFunc fn);
 LuaStateObject *GetGlobalLuaState(void);
+LuaStateObject *LuaState_borrow(lua_State *L);
 
 DL_EXPORT(void) initlua(void);
 
@@ -0,0 +1,92 @@
+/*
+
+ Lunatic Python
+ --------------
+
+ Copyright (c) 2002-2005  Gustavo Niemeyer <gustavo@niemeyer.net>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef LUNATICPYTHON_H
+#define LUNATICPYTHON_H
+
+/*
+ * C interface for other extensions, exported by the lua module as
+ * capsules. Include after Python.h and lua.h.
+ */
+
+/**
+ * Push the Lua value for 'o'. Return 1 when pushed, 0 to leave 'o' to
+ * the default conversion, or -1 with a Python exception set.
+ */
+typedef int (*LuaFromPyFunc)(lua_State *L, PyObject *o);
+
+/**
+ * Return a new reference to the Python value for the Lua value at
+ * absolute index 'n'. NULL without an exception set leaves the value
+ * to the default conversion.
+ */
+typedef PyObject *(*LuaToPyFunc)(lua_State *L, int n);
+
+#define LUA_CONVERTERS_VERSION 1
+#define LUA_CONVERTERS_CAPSULE "lua._converters"
+
+/* Converter registration, in the lua._converters capsule */
+typedef struct {
+	int version;
+	/* Convert instances of 'type' and its subclasses to Lua */
+	int (*from_py)(PyTypeObject *type, LuaFromPyFunc fn);
+	/* Convert Lua values with the metatable registered as 'tname'
+	 * (which must stay valid) to Python */
+	int (*to_py)(const char *tname, LuaToPyFunc fn);
+} LuaConverters;
+
+#define LuaConverters_Import() \
+	((LuaConverters *)PyCapsule_Import(LUA_CONVERTERS_CAPSULE, 0))
+
+#define LUA_CAPI_VERSION 1
+#define LUA_CAPI_CAPSULE "lua._C_API"
+
+/**
+ * Bridge functions, in the lua._C_API capsule. 'state' arguments are
+ * lua.LuaState objects. Check 'version' before use: later versions
+ * only add members at the end.
+ */
+typedef struct {
+	int version;
+	/* The lua_State of 'state', or NULL with TypeError set */
+	lua_State *(*get_state)(PyObject *state);
+	/* The lua module's global state (borrowed) */
+	PyObject *(*global_state)(void);
+	/* Python value for the Lua value at 'n' */
+	PyObject *(*to_py)(PyObject *state, int n);
+	/* lua.LuaObject referencing the value at 'n', whatever its type */
+	PyObject *(*wrap)(PyObject *state, int n);
+	/* Push 'o', returning 0 with a Python exception set on failure */
+	int (*push)(PyObject *state, PyObject *o);
+	/* Push 'o' from within Lua code, raising Lua errors on failure */
+	int (*py_convert)(lua_State *L, PyObject *o, int withnone);
+	/* All states are guarded by the interpreter lock: take it before
+	 * touching a state from a thread not holding it */
+	PyGILState_STATE (*lock)(void);
+	void (*unlock)(PyGILState_STATE gstate);
+	LuaConverters *converters;
+} LuaCAPI;
+
+#define LuaCAPI_Import() \
+	((LuaCAPI *)PyCapsule_Import(LUA_CAPI_CAPSULE, 0))
+
+#endif
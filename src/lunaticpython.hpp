@@ -0,0 +1,390 @@
+/*
+
+ Lunatic Python
+ --------------
+
+ Copyright (c) 2002-2005  Gustavo Niemeyer <gustavo@niemeyer.net>
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+#ifndef LUNATICPYTHON_HPP
+#define LUNATICPYTHON_HPP
+
+/*
+ * Header-only C++17 layer for programs linking the bridge sources.
+ *
+ *	lunatic::Lock lock;
+ *	lunatic::State state;
+ *	double d = lunatic::call<double(double, double)>(state, "math.max", 1, 2);
+ *
+ * Arguments and results are marshalled according to the signature, so
+ * numbers, booleans and strings go straight to the Lua stack; Object
+ * and Ref values cross through the bridge conversions. Errors throw
+ * lunatic::Error; a Python exception raised inside the call is left
+ * pending and thrown as lunatic::PythonError. Everything here must be
+ * used with the interpreter lock held.
+ */
+
+#include <Python.h>
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lunaticpython.h"
+#include "pythoninlua.h"
+#include "luainpython.h"
+}
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace lunatic {
+
+class Error : public std::runtime_error {
+public:
+	using std::runtime_error::runtime_error;
+};
+
+/* Thrown with the Python exception still pending */
+class PythonError : public Error {
+public:
+	using Error::Error;
+};
+
+/* Scoped interpreter lock */
+class Lock {
+public:
+	Lock() : gstate(PyGILState_Ensure()) {}
+	~Lock() { PyGILState_Release(gstate); }
+	Lock(const Lock &) = delete;
+	Lock &operator=(const Lock &) = delete;
+private:
+	PyGILState_STATE gstate;
+};
+
+/* Owned Python reference */
+class Object {
+public:
+	Object() noexcept : o(nullptr) {}
+	/* Takes over a new reference; throws PythonError on NULL */
+	static Object steal(PyObject *o)
+	{
+		if (!o)
+			throw PythonError("python error");
+		return Object(o);
+	}
+	static Object borrow(PyObject *o)
+	{
+		Py_XINCREF(o);
+		return Object(o);
+	}
+	Object(Object &&other) noexcept : o(other.o) { other.o = nullptr; }
+	Object &operator=(Object &&other) noexcept
+	{
+		std::swap(o, other.o);
+		return *this;
+	}
+	Object(const Object &) = delete;
+	Object &operator=(const Object &) = delete;
+	~Object() { Py_XDECREF(o); }
+
+	PyObject *get() const noexcept { return o; }
+	PyObject *release() noexcept { return std::exchange(o, nullptr); }
+	explicit operator bool() const noexcept { return o != nullptr; }
+private:
+	explicit Object(PyObject *o) noexcept : o(o) {}
+	PyObject *o;
+};
+
+/* Owned lua.LuaState */
+class State {
+public:
+	/* A new state, like lua.new_state() */
+	State()
+		: obj(Object::steal(PyObject_CallObject(
+			(PyObject *)&LuaStateObjectType, NULL))) {}
+	/* The lua module's global state */
+	static State global()
+	{
+		return State(Object::borrow((PyObject *)GetGlobalLuaState()));
+	}
+	explicit State(Object o) : obj(std::move(o))
+	{
+		if (!PyObject_TypeCheck(obj.get(), &LuaStateObjectType))
+			throw Error("LuaState expected");
+	}
+
+	LuaStateObject *object() const noexcept
+	{
+		return (LuaStateObject *)obj.get();
+	}
+	lua_State *L() const noexcept { return object()->LuaState; }
+	State share() const { return State(Object::borrow(obj.get())); }
+private:
+	Object obj;
+};
+
+/* Owned registry reference to a Lua value, keeping its state alive */
+class Ref {
+public:
+	/* References the value on top of the stack, popping it */
+	explicit Ref(const State &state) : state(state.share()),
+		ref(luaL_ref(state.L(), LUA_REGISTRYINDEX)) {}
+	Ref(Ref &&other) noexcept : state(std::move(other.state)),
+		ref(std::exchange(other.ref, LUA_NOREF)) {}
+	Ref &operator=(Ref &&other) noexcept
+	{
+		std::swap(state, other.state);
+		std::swap(ref, other.ref);
+		return *this;
+	}
+	Ref(const Ref &) = delete;
+	Ref &operator=(const Ref &) = delete;
+	~Ref()
+	{
+		if (ref != LUA_NOREF)
+			luaL_unref(state.L(), LUA_REGISTRYINDEX, ref);
+	}
+
+	void push(lua_State *L) const { lua_rawgeti(L, LUA_REGISTRYINDEX, ref); }
+	/* The Python value, as the bridge converts it */
+	Object get() const
+	{
+		push(state.L());
+		PyObject *o = LuaConvert(state.object(), -1);
+		lua_pop(state.L(), 1);
+		return Object::steal(o);
+	}
+private:
+	State state;
+	int ref;
+};
+
+namespace detail {
+
+/* Throw the error on top of the stack, popping it */
+[[noreturn]] inline void raise(lua_State *L)
+{
+	if (py_exception_restore(L, -1)) {
+		lua_pop(L, 1);
+		throw PythonError("python exception in lua call");
+	}
+	std::string msg = lua_isstring(L, -1) ? lua_tostring(L, -1)
+					      : "lua error";
+	lua_pop(L, 1);
+	throw Error(msg);
+}
+
+/* Push a Python object in protected mode, leaving it on the stack. */
+struct PushObject {
+	PyObject *o;
+	int ref;
+	static int run(lua_State *L)
+	{
+		PushObject *p = (PushObject *)lua_touserdata(L, 1);
+		py_convert(L, p->o, 0);
+		p->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		return 0;
+	}
+};
+
+inline void push_object(lua_State *L, PyObject *o)
+{
+	PushObject p = {o, LUA_NOREF};
+	if (lua_cpcall(L, PushObject::run, &p) != 0)
+		raise(L);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, p.ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, p.ref);
+}
+
+} /* namespace detail */
+
+/**
+ * Marshal<T>::push(L, value) pushes a T, Marshal<T>::get(state, n)
+ * reads the value at 'n' as a T.
+ */
+template <class T, class = void>
+struct Marshal;
+
+template <>
+struct Marshal<bool> {
+	static void push(lua_State *L, bool b) { lua_pushboolean(L, b); }
+	static bool get(const State &state, int n)
+	{
+		return lua_toboolean(state.L(), n);
+	}
+};
+
+template <class T>
+struct Marshal<T, std::enable_if_t<std::is_integral_v<T> &&
+				   !std::is_same_v<T, bool>>> {
+	static void push(lua_State *L, T i) { lua_pushinteger(L, (lua_Integer)i); }
+	static T get(const State &state, int n)
+	{
+		if (!lua_isnumber(state.L(), n))
+			throw Error("number expected");
+		return (T)lua_tointeger(state.L(), n);
+	}
+};
+
+template <class T>
+struct Marshal<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+	static void push(lua_State *L, T d) { lua_pushnumber(L, (lua_Number)d); }
+	static T get(const State &state, int n)
+	{
+		if (!lua_isnumber(state.L(), n))
+			throw Error("number expected");
+		return (T)lua_tonumber(state.L(), n);
+	}
+};
+
+template <>
+struct Marshal<const char *> {
+	static void push(lua_State *L, const char *s) { lua_pushstring(L, s); }
+};
+
+template <>
+struct Marshal<std::string_view> {
+	static void push(lua_State *L, std::string_view s)
+	{
+		lua_pushlstring(L, s.data(), s.size());
+	}
+};
+
+template <>
+struct Marshal<std::string> {
+	static void push(lua_State *L, const std::string &s)
+	{
+		lua_pushlstring(L, s.data(), s.size());
+	}
+	static std::string get(const State &state, int n)
+	{
+		size_t len;
+		const char *s = lua_tolstring(state.L(), n, &len);
+		if (!s)
+			throw Error("string expected");
+		return std::string(s, len);
+	}
+};
+
+template <>
+struct Marshal<Object> {
+	static void push(lua_State *L, const Object &o)
+	{
+		if (o)
+			detail::push_object(L, o.get());
+		else
+			lua_pushnil(L);
+	}
+	static Object get(const State &state, int n)
+	{
+		return Object::steal(LuaConvert(state.object(), n));
+	}
+};
+
+template <>
+struct Marshal<Ref> {
+	static void push(lua_State *L, const Ref &r) { r.push(L); }
+	static Ref get(const State &state, int n)
+	{
+		lua_pushvalue(state.L(), n);
+		return Ref(state);
+	}
+};
+
+namespace detail {
+
+/* Resolve the dotted path at 1 from the globals and call it with the
+ * remaining arguments, all under lua_pcall. */
+inline int call_path(lua_State *L)
+{
+	size_t len;
+	const char *path = lua_tolstring(L, 1, &len);
+	const char *end = path + len;
+	const char *dot;
+
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	for (;;) {
+		for (dot = path; dot != end && *dot != '.'; dot++)
+			;
+		lua_pushlstring(L, path, dot - path);
+		lua_gettable(L, -2);
+		lua_remove(L, -2);
+		if (dot == end)
+			break;
+		path = dot + 1;
+	}
+	lua_replace(L, 1);
+	lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+	return lua_gettop(L);
+}
+
+template <class Sig>
+struct Call;
+
+template <class R, class... Args>
+struct Call<R(Args...)> {
+	template <class... A>
+	static R invoke(const State &state, std::string_view path, A &&...args)
+	{
+		static_assert(sizeof...(A) == sizeof...(Args),
+			      "argument count doesn't match the signature");
+		lua_State *L = state.L();
+		int top = lua_gettop(L);
+
+		lua_pushcfunction(L, call_path);
+		lua_pushlstring(L, path.data(), path.size());
+		try {
+			(Marshal<std::decay_t<Args>>::push(L, std::forward<A>(args)), ...);
+		} catch (...) {
+			lua_settop(L, top);
+			throw;
+		}
+		if (lua_pcall(L, sizeof...(Args) + 1,
+			      std::is_void_v<R> ? 0 : 1, 0) != 0)
+			raise(L);
+		if constexpr (std::is_void_v<R>) {
+			lua_settop(L, top);
+		} else {
+			struct Pop {
+				lua_State *L;
+				int top;
+				~Pop() { lua_settop(L, top); }
+			} pop = {L, top};
+			return Marshal<std::decay_t<R>>::get(state, -1);
+		}
+	}
+};
+
+} /* namespace detail */
+
+/**
+ * Call the Lua function at the dotted global 'path' with the signature
+ * 'Sig', e.g. call<int(const char *)>(state, "string.len", "abc").
+ */
+template <class Sig, class... A>
+inline auto call(const State &state, std::string_view path, A &&...args)
+{
+	return detail::Call<Sig>::invoke(state, path, std::forward<A>(args)...);
+}
+
+} /* namespace lunatic */
+
+#endif
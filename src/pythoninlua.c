@@ -21,10 +21,14 @@
 
 */
 #include <Python.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
 
 #include <lua.h>
 #include <lauxlib.h>
 
+#include "lunaticpython.h"
 #include "pythoninlua.h"
 #include "luainpython.h"
 
@@ -96,21 +100,276 @@ void tableDump(lua_State *L, int t)
 }
 
 /* Replacement for luaL_checkudata that doesn't throw an error */
-py_object* check_py_object(lua_State *L, int ud)
+static void *check_udata(lua_State *L, int ud, const char *tname)
 {
 	void *p = lua_touserdata(L, ud);
 	if (p != NULL) {	/* value is a userdata? */
 		if (lua_getmetatable(L, ud)) { /* does it have a metatable? */
-			lua_getfield(L, LUA_REGISTRYINDEX, POBJECT);
-			if (lua_rawequal(L, -1, -2)) {
-				lua_pop(L, 2);
+			int eq;
+			lua_getfield(L, LUA_REGISTRYINDEX, tname);
+			eq = lua_rawequal(L, -1, -2);
+			lua_pop(L, 2);
+			if (eq)
 				return p;
-			}
 		}
 	}
 	return NULL;
 }
 
+py_object* check_py_object(lua_State *L, int ud)
+{
+	return (py_object *) check_udata(L, ud, POBJECT);
+}
+
+py_view* check_py_view(lua_State *L, int ud)
+{
+	return (py_view *) check_udata(L, ud, PVIEW);
+}
+
+py_view* check_py_strview(lua_State *L, int ud)
+{
+	return (py_view *) check_udata(L, ud, PSTRVIEW);
+}
+
+PyObject* check_py_sink(lua_State *L, int ud)
+{
+	PyObject **p = (PyObject **) check_udata(L, ud, PSINK);
+	return p ? *p : NULL;
+}
+
+py_struct* check_py_struct(lua_State *L, int ud)
+{
+	return (py_struct *) check_udata(L, ud, PSTRUCT);
+}
+
+PyObject* check_py_numarray(lua_State *L, int ud)
+{
+	PyObject **p = (PyObject **) check_udata(L, ud, PNUMARRAY);
+	return p ? *p : NULL;
+}
+
+/**
+ * Raise the pending Python exception as a Lua error. The exception is
+ * carried as a userdata, so Lua code can inspect it and it comes back
+ * unchanged when the error reaches Python again; nothing is formatted
+ * until asked for. A lua.LuaError wrapping a value of this state is
+ * unwrapped to the original Lua value. Without a pending exception,
+ * 'where' is raised as a plain message. It is copied, so it may point
+ * into a temporary buffer.
+ */
+int py_error(lua_State *L, const char *where)
+{
+	PyObject *type, *value, *tb;
+	py_exception *e;
+
+	PyErr_Fetch(&type, &value, &tb);
+	if (!type)
+		return luaL_error(L, "%s", where);
+
+	if (PyErr_GivenExceptionMatches(type, LuaError)) {
+		PyObject *args, *arg = NULL;
+		PyErr_NormalizeException(&type, &value, &tb);
+		args = value ? PyObject_GetAttrString(value, "args") : NULL;
+		if (args && PyTuple_Check(args) && PyTuple_GET_SIZE(args) == 1)
+			arg = PyTuple_GET_ITEM(args, 0);
+		if (arg && LuaObject_Check(arg)) {
+			lua_State *LuaState = ((LuaStateObject *)((LuaObject *)arg)->state)->LuaState;
+			int same;
+			/* Threads of one state share its registry */
+			lua_pushvalue(LuaState, LUA_REGISTRYINDEX);
+			lua_pushvalue(L, LUA_REGISTRYINDEX);
+			same = lua_topointer(LuaState, -1) == lua_topointer(L, -1);
+			lua_pop(L, 1);
+			lua_pop(LuaState, 1);
+			if (same) {
+				lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject *)arg)->ref);
+				Py_DECREF(args);
+				Py_DECREF(type);
+				Py_XDECREF(value);
+				Py_XDECREF(tb);
+				return lua_error(L);
+			}
+		}
+		Py_XDECREF(args);
+		PyErr_Clear();
+	}
+
+	e = (py_exception *) lua_newuserdata(L, sizeof(py_exception));
+	e->type = type;
+	e->value = value;
+	e->tb = tb;
+	luaL_getmetatable(L, PEXC);
+	lua_setmetatable(L, -2);
+	/* 'where' lives in the environment, which only holds tables */
+	lua_createtable(L, 1, 0);
+	lua_pushstring(L, where);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+	return lua_error(L);
+}
+
+/* Raise the pending import error, naming the module. */
+static int py_import_error(lua_State *L, const char *name)
+{
+	return py_error(L, lua_pushfstring(L, "failed importing '%s'", name));
+}
+
+/* Same for the lazy module proxy at 'ud', which keeps its name. */
+static int py_lazy_error(lua_State *L, int ud)
+{
+	lua_getfenv(L, ud);
+	lua_rawgeti(L, -1, 1);
+	return py_import_error(L, lua_tostring(L, -1));
+}
+
+/**
+ * Restore the Python exception carried by the error value at 'n' as the
+ * pending exception. Returns 0 if the value isn't one.
+ */
+int py_exception_restore(lua_State *L, int n)
+{
+	py_exception *e = (py_exception *) check_udata(L, n, PEXC);
+
+	if (!e)
+		return 0;
+	Py_INCREF(e->type);
+	Py_XINCREF(e->value);
+	Py_XINCREF(e->tb);
+	PyErr_Restore(e->type, e->value, e->tb);
+	return 1;
+}
+
+/* Push the 'where' of the exception at 'n', returning it. */
+static const char *py_exception_where(lua_State *L, int n)
+{
+	lua_getfenv(L, n);
+	lua_rawgeti(L, -1, 1);
+	lua_remove(L, -2);
+	return lua_tostring(L, -1);
+}
+
+static int py_exception_gc(lua_State *L)
+{
+	py_exception *e = (py_exception *) luaL_checkudata(L, 1, PEXC);
+	Py_XDECREF(e->type);
+	Py_XDECREF(e->value);
+	Py_XDECREF(e->tb);
+	e->type = e->value = e->tb = NULL;
+	return 0;
+}
+
+/* Exception class name as the interpreter prints it. */
+static const char *py_exception_name(PyObject *type)
+{
+	const char *name = PyExceptionClass_Name(type);
+	if (strncmp(name, "exceptions.", 11) == 0)
+		name += 11;
+	return name;
+}
+
+static int py_exception_tostring(lua_State *L)
+{
+	py_exception *e = (py_exception *) luaL_checkudata(L, 1, PEXC);
+	const char *where = py_exception_where(L, 1);
+	PyObject *str;
+
+	PyErr_NormalizeException(&e->type, &e->value, &e->tb);
+	str = e->value ? PyObject_Str(e->value) : NULL;
+	if (!str) {
+		PyErr_Clear();
+		lua_pushfstring(L, "%s: %s", where,
+				py_exception_name(e->type));
+		return 1;
+	}
+	if (PyString_GET_SIZE(str) == 0)
+		lua_pushfstring(L, "%s: %s", where,
+				py_exception_name(e->type));
+	else
+		lua_pushfstring(L, "%s: %s: %s", where,
+				py_exception_name(e->type),
+				PyString_AS_STRING(str));
+	Py_DECREF(str);
+	return 1;
+}
+
+/* Format the traceback the way the interpreter prints it. */
+static int py_exception_traceback(lua_State *L, py_exception *e)
+{
+	PyObject *mod, *lines, *empty, *text = NULL;
+
+	mod = PyImport_ImportModule("traceback");
+	if (!mod)
+		return py_error(L, "failed importing traceback");
+	lines = PyObject_CallMethod(mod, "format_exception", "OOO", e->type,
+				    e->value ? e->value : Py_None,
+				    e->tb ? e->tb : Py_None);
+	Py_DECREF(mod);
+	if (lines) {
+		empty = PyString_FromString("");
+		if (empty)
+			text = _PyString_Join(empty, lines);
+		Py_XDECREF(empty);
+		Py_DECREF(lines);
+	}
+	if (!text)
+		return py_error(L, "failed formatting traceback");
+	lua_pushlstring(L, PyString_AS_STRING(text), PyString_GET_SIZE(text));
+	Py_DECREF(text);
+	return 1;
+}
+
+/**
+ * Exception fields: 'type' and 'value' as python objects, 'where' the
+ * bridge operation that failed, and 'traceback' formatted on demand.
+ */
+static int py_exception_index(lua_State *L)
+{
+	py_exception *e = (py_exception *) luaL_checkudata(L, 1, PEXC);
+	const char *key = luaL_checkstring(L, 2);
+
+	if (strcmp(key, "type") == 0)
+		return py_convert(L, e->type, 0);
+	if (strcmp(key, "where") == 0) {
+		py_exception_where(L, 1);
+		return 1;
+	}
+	if (strcmp(key, "value") == 0) {
+		PyErr_NormalizeException(&e->type, &e->value, &e->tb);
+		return py_convert(L, e->value ? e->value : Py_None, 0);
+	}
+	if (strcmp(key, "traceback") == 0)
+		return py_exception_traceback(L, e);
+	lua_pushnil(L);
+	return 1;
+}
+
+static const luaL_reg py_exception_lib[] = {
+	{"__gc",	py_exception_gc},
+	{"__tostring",	py_exception_tostring},
+	{"__index",	py_exception_index},
+	{NULL, NULL}
+};
+
+static int py_convert_sink(lua_State *L, PyObject *o)
+{
+	PyObject **p = (PyObject **) lua_newuserdata(L, sizeof(PyObject *));
+	Py_INCREF(o);
+	*p = o;
+	luaL_getmetatable(L, PSINK);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int py_convert_numarray(lua_State *L, PyObject *o)
+{
+	PyObject **p = (PyObject **) lua_newuserdata(L, sizeof(PyObject *));
+	Py_INCREF(o);
+	*p = o;
+	luaL_getmetatable(L, PNUMARRAY);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
 static int py_convert_custom(lua_State *L, PyObject *o, int asindx)
 {
 	int ret = 0;
@@ -128,9 +387,145 @@ static int py_convert_custom(lua_State *L, PyObject *o, int asindx)
 	return ret;
 }
 
+static int py_convert_bool(lua_State *L, PyObject *o)
+{
+	lua_pushboolean(L, o == Py_True);
+	return 1;
+}
+
+static int py_convert_string(lua_State *L, PyObject *o)
+{
+	char *s;
+	Py_ssize_t len;
+	if (PyString_AsStringAndSize(o, &s, &len) < 0)
+		luaL_error(L, "failed string conversion");
+	lua_pushlstring(L, s, len);
+	return 1;
+}
+
+static int py_convert_int(lua_State *L, PyObject *o)
+{
+	lua_pushinteger(L, PyInt_AsLong(o));
+	return 1;
+}
+
+static int py_convert_float(lua_State *L, PyObject *o)
+{
+	lua_pushnumber(L, PyFloat_AsDouble(o));
+	return 1;
+}
+
+static int py_convert_luaobject(lua_State *L, PyObject *o)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)o)->ref);
+	return 1;
+}
+
+/* Frozen mappings push their read-only proxy. */
+static int py_convert_frozen(lua_State *L, PyObject *o)
+{
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaFrozenObject *)o)->ref);
+	return 1;
+}
+
+/* Session slots push the value they hold. */
+static int py_convert_slot(lua_State *L, PyObject *o)
+{
+	LuaSlotObject *slot = (LuaSlotObject *)o;
+	if (!LuaSlot_valid(slot) || slot->session->state->LuaState != L)
+		luaL_error(L, "slot of another or released session");
+	lua_pushvalue(L, slot->index);
+	return 1;
+}
+
+static int py_convert_container(lua_State *L, PyObject *o)
+{
+	return py_convert_custom(L, o, 1);
+}
+
+static int py_convert_function(lua_State *L, PyObject *o)
+{
+	py_convert_custom(L, o, 0);
+	lua_pushcclosure(L, py_asfunc_call, 1);
+	return 1;
+}
+
+/* Python to Lua converters, an open addressed table keyed by type */
+#define PY_CONVERTERS_SIZE 256
+
+typedef struct {
+	PyTypeObject *type;
+	LuaFromPyFunc fn;
+} py_converter;
+
+static py_converter py_converters[PY_CONVERTERS_SIZE];
+static int py_converters_count = 0;
+static int py_converters_ready = 0;
+
+static void py_converters_init(void);
+
+#define py_converter_slot(type) \
+	(((size_t)(type) >> 4) & (PY_CONVERTERS_SIZE-1))
+
+static py_converter *py_converter_get(PyTypeObject *type)
+{
+	size_t i = py_converter_slot(type);
+	while (py_converters[i].type && py_converters[i].type != type)
+		i = (i+1) & (PY_CONVERTERS_SIZE-1);
+	return &py_converters[i];
+}
+
+/**
+ * Register 'fn' to convert instances of 'type' (and its subclasses,
+ * unless they have their own) to Lua. A NULL 'fn' restores the default
+ * conversion.
+ */
+int py_converter_register(PyTypeObject *type, LuaFromPyFunc fn)
+{
+	py_converter *c;
+
+	if (!py_converters_ready)
+		py_converters_init();
+	c = py_converter_get(type);
+	if (!c->type) {
+		/* Keep probe sequences short. */
+		if (py_converters_count >= PY_CONVERTERS_SIZE/2) {
+			PyErr_SetString(PyExc_RuntimeError,
+					"too many converters registered");
+			return -1;
+		}
+		Py_INCREF(type);
+		c->type = type;
+		py_converters_count++;
+	}
+	c->fn = fn;
+	return 0;
+}
+
+static void py_converters_init(void)
+{
+	py_converters_ready = 1;
+	py_converter_register(&PyBool_Type, py_convert_bool);
+	py_converter_register(&PyString_Type, py_convert_string);
+	py_converter_register(&PyInt_Type, py_convert_int);
+	py_converter_register(&PyFloat_Type, py_convert_float);
+	py_converter_register(&LuaObjectType, py_convert_luaobject);
+	py_converter_register(&LuaSinkObjectType, py_convert_sink);
+	py_converter_register(&LuaNumArrayObjectType, py_convert_numarray);
+	py_converter_register(&LuaSlotObjectType, py_convert_slot);
+	py_converter_register(&LuaFrozenObjectType, py_convert_frozen);
+	py_converter_register(&PyDict_Type, py_convert_container);
+	py_converter_register(&PyList_Type, py_convert_container);
+	py_converter_register(&PyTuple_Type, py_convert_container);
+	py_converter_register(&PyFunction_Type, py_convert_function);
+	py_converter_register(&PyCFunction_Type, py_convert_function);
+}
+
 int py_convert(lua_State *L, PyObject *o, int withnone)
 {
-	int ret = 0;
+	PyTypeObject *type;
+	int ret;
+
 	if (o == Py_None) {
 		if (withnone) {
 			lua_pushliteral(L, "Py_None");
@@ -139,46 +534,32 @@ int py_convert(lua_State *L, PyObject *o, int withnone)
 				lua_pop(L, 1);
 				luaL_error(L, "lost none from registry");
 			}
-			ret = 1;
 		} else {
 			/* Not really needed, but this way we may check
 			 * for errors with ret == 0. */
 			lua_pushnil(L);
-			ret = 1;
-		}
-	} else if (o == Py_True) {
-		lua_pushboolean(L, 1);
-		ret = 1;
-	} else if (o == Py_False) {
-		lua_pushboolean(L, 0);
-		ret = 1;
-	} else if (PyString_Check(o)) {
-		char *s;
-		Py_ssize_t len;
-		if (PyString_AsStringAndSize(o, &s, &len) < 0) {
-			luaL_error(L, "failed string conversion");
 		}
-		lua_pushlstring(L, s, len);
-		ret = 1;
-	} else if (PyInt_Check(o)) {
-		lua_pushinteger(L, PyInt_AsLong(o));
-		ret = 1;
-	} else if (PyFloat_Check(o)) {
-		lua_pushnumber(L, PyFloat_AsDouble(o));
-		ret = 1;
-	} else if (LuaObject_Check(o)) {
-		lua_rawgeti(L, LUA_REGISTRYINDEX, ((LuaObject*)o)->ref);
-		ret = 1;
-	} else {
-		int asindx = 0;
-		if (PyDict_Check(o) || PyList_Check(o) || PyTuple_Check(o))
-			asindx = 1;
-		ret = py_convert_custom(L, o, asindx);
-		if (ret && !asindx &&
-		    (PyFunction_Check(o) || PyCFunction_Check(o)))
-			lua_pushcclosure(L, py_asfunc_call, 1);
+		return 1;
 	}
-	return ret;
+
+	if (!py_converters_ready)
+		py_converters_init();
+
+	/* The nearest type in the base chain with a converter wins. */
+	for (type = o->ob_type; type; type = type->tp_base) {
+		py_converter *c = py_converter_get(type);
+		if (!c->type)
+			continue;
+		if (!c->fn)
+			break;
+		ret = c->fn(L, o);
+		if (ret == -1)
+			py_error(L, "failed converting python object");
+		if (ret)
+			return ret;
+		break;
+	}
+	return py_convert_custom(L, o, 0);
 }
 
 static int py_object_call(lua_State *L)
@@ -201,33 +582,58 @@ static int py_object_call(lua_State *L)
 
 	args = PyTuple_New(nargs);
 	if (!args) {
-                PyErr_Print();
-		luaL_error(L, "failed to create arguments tuple");
+		py_error(L, "failed to create arguments tuple");
 		return 0;
 	}
 	
 	for (i = 0; i != nargs; i++) {
 		PyObject *arg = LuaConvertPy(L, i+2);
 		if (!arg) {
-			luaL_error(L, "failed to convert argument #%d", i+1);
 			Py_DECREF(args);
+			luaL_error(L, "failed to convert argument #%d", i+1);
 			return 0;
 		}
 		PyTuple_SetItem(args, i, arg);
 	}
 
 	value = PyObject_CallObject(obj->o, args);
+	Py_DECREF(args);
 	if (value) {
 		ret = py_convert(L, value, 0);
 		Py_DECREF(value);
 	} else {
-		PyErr_Print();
-		luaL_error(L, "error calling python function");
+		py_error(L, "error calling python function");
 	}
 	
 	return ret;
 }
 
+/**
+ * Drop the snapshot taken of 'o' by python.snapshot(), or all of them
+ * when 'o' is NULL.
+ */
+void py_snapshot_invalidate(lua_State *L, PyObject *o)
+{
+	int i;
+
+	if (!o) {
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, PSNAPSHOTS);
+		return;
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, PSNAPSHOTS);
+	if (lua_istable(L, -1)) {
+		for (i = 1; i <= 2; i++) {
+			lua_rawgeti(L, -1, i);
+			lua_pushlightuserdata(L, o);
+			lua_pushnil(L);
+			lua_rawset(L, -3);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+}
+
 static int _p_object_newindex_set(lua_State *L, py_object *obj,
 				  int keyn, int valuen)
 {
@@ -239,6 +645,8 @@ static int _p_object_newindex_set(lua_State *L, py_object *obj,
 		return 0;
 	}
 
+	py_snapshot_invalidate(L, obj->o);
+
 	if (!lua_isnil(L, valuen)) {
 		value = LuaConvertPy(L, valuen);
 		if (!value) {
@@ -248,15 +656,16 @@ static int _p_object_newindex_set(lua_State *L, py_object *obj,
 		}
 
 		if (PyObject_SetItem(obj->o, key, value) == -1) {
-			PyErr_Print();
-			luaL_error(L, "failed to set item");
+			Py_DECREF(key);
+			Py_DECREF(value);
+			py_error(L, "failed to set item");
 		}
 
 		Py_DECREF(value);
 	} else {
 		if (PyObject_DelItem(obj->o, key) == -1) {
-			PyErr_Print();
-			luaL_error(L, "failed to delete item");
+			Py_DECREF(key);
+			py_error(L, "failed to delete item");
 		}
 	}
 
@@ -303,8 +712,7 @@ static int py_object_newindex(lua_State *L)
 
 	if (PyObject_SetAttrString(obj->o, (char*)attr, value) == -1) {
 		Py_DECREF(value);
-                PyErr_Print();
-		luaL_error(L, "failed to set value");
+		py_error(L, "failed to set value");
 		return 0;
 	}
 
@@ -353,6 +761,59 @@ static int py_object_index_get(lua_State *L)
 	return _p_object_index_get(L, obj, 1);
 }
 
+/* Marks the environment table of module userdata made by python.import
+ * as their attribute cache. */
+static char py_module_cache_key;
+
+/**
+ * Index a module through its attribute cache. Entries are validated
+ * against the module dict by identity, so rebinding a module attribute
+ * is always seen; only the conversion is saved. Returns -1 when the
+ * cache can't answer.
+ */
+static int py_module_index(lua_State *L, py_object *obj)
+{
+	PyObject *value;
+	py_object *id;
+
+	value = PyDict_GetItemString(PyModule_GetDict(obj->o),
+				     lua_tostring(L, 2));
+	if (!value)
+		return -1;
+
+	lua_getfenv(L, 1);
+	lua_pushlightuserdata(L, &py_module_cache_key);
+	lua_rawget(L, -2);
+	if (!lua_toboolean(L, -1)) {
+		lua_pop(L, 2);
+		return -1;
+	}
+	lua_pop(L, 1);
+
+	/* fenv[1] keeps the cached objects alive and fenv[2] holds their
+	 * converted values. */
+	lua_rawgeti(L, -1, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	id = check_py_object(L, -1);
+	lua_pop(L, 1);
+	if (!id || id->o != value) {
+		py_convert_custom(L, value, 0);
+		lua_pushvalue(L, 2);
+		lua_insert(L, -2);
+		lua_rawset(L, -3);
+		lua_rawgeti(L, -2, 2);
+		lua_pushvalue(L, 2);
+		py_convert(L, value, 0);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	lua_rawgeti(L, -2, 2);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
 static int py_object_index(lua_State *L)
 {
 	py_object *obj = check_py_object(L, 1);
@@ -384,19 +845,66 @@ static int py_object_index(lua_State *L)
 		return 1;
 	}
 
+	if (PyModule_CheckExact(obj->o)) {
+		ret = py_module_index(L, obj);
+		if (ret != -1)
+			return ret;
+		ret = 0;
+	}
 
 	value = PyObject_GetAttrString(obj->o, (char*)attr);
 	if (value) {
 		ret = py_convert(L, value, 0);
 		Py_DECREF(value);
 	} else {
-		PyErr_Clear();
-		luaL_error(L, "unknown attribute in python object");
+		py_error(L, "unknown attribute in python object");
 	}
 
 	return ret;
 }
 
+/**
+ * python.fields(obj, ...) - several fields of a python object in one
+ * call, as multiple values: attributes, or items for objects indexed
+ * with python.asindx() (nil when missing).
+ */
+static int py_fields(lua_State *L)
+{
+	py_object *obj = check_py_object(L, 1);
+	int i, n = lua_gettop(L);
+
+	if (!obj && !(obj = py_lazy_resolve(L, 1))) {
+		if (PyErr_Occurred())
+			return py_lazy_error(L, 1);
+		return luaL_argerror(L, 1, "not a python object");
+	}
+	luaL_checkstack(L, n, "too many fields");
+
+	for (i = 2; i <= n; i++) {
+		PyObject *value;
+		if (obj->asindx) {
+			PyObject *key = LuaConvertPy(L, i);
+			if (!key)
+				return luaL_argerror(L, i, "failed to convert key");
+			value = PyObject_GetItem(obj->o, key);
+			Py_DECREF(key);
+			if (!value) {
+				PyErr_Clear();
+				lua_pushnil(L);
+				continue;
+			}
+		} else {
+			const char *attr = luaL_checkstring(L, i);
+			value = PyObject_GetAttrString(obj->o, (char*)attr);
+			if (!value)
+				return py_error(L, "unknown attribute in python object");
+		}
+		py_convert(L, value, 0);
+		Py_DECREF(value);
+	}
+	return n - 1;
+}
+
 static int py_object_gc(lua_State *L)
 {
 	py_object *obj = check_py_object(L, 1);
@@ -427,80 +935,1429 @@ static int py_object_tostring(lua_State *L)
 	return 1;
 }
 
-static const luaL_reg py_object_lib[] = {
-	{"__call",	py_object_call},
-	{"__index",	py_object_index},
-	{"__newindex",	py_object_newindex},
-	{"__gc",	py_object_gc},
-	{"__tostring",	py_object_tostring},
-	{NULL, NULL}
-};
-
-static int py_run(lua_State *L, int eval)
+/* Iteration step over a list or tuple. Upvalues: object, next index,
+ * whether to return (index, value) pairs. */
+static int py_iter_seq(lua_State *L)
 {
-	const char *s;
-	char *buffer = NULL;
-	PyObject *m, *d, *o;
-	int ret = 0;
-	size_t len;
+	PyObject *o = check_py_object(L, lua_upvalueindex(1))->o;
+	Py_ssize_t i = (Py_ssize_t)lua_tointeger(L, lua_upvalueindex(2));
 
-	s = luaL_checkstring(L, 1);
-	if (!s)
+	if (i >= PySequence_Fast_GET_SIZE(o))
 		return 0;
+	lua_pushinteger(L, i+1);
+	lua_replace(L, lua_upvalueindex(2));
 
-	if (!eval) {
-		len = strlen(s)+1;
-		buffer = (char *) malloc(len+1);
-		if (!buffer) {
-			luaL_error(L, "Failed allocating buffer for execution");
-			return 0;
-		}
-		strcpy(buffer, s);
-		buffer[len-1] = '\n';
-		buffer[len] = '\0';
-		s = buffer;
+	if (lua_toboolean(L, lua_upvalueindex(3))) {
+		lua_pushinteger(L, i);
+		py_convert(L, PySequence_Fast_GET_ITEM(o, i), 0);
+		return 2;
 	}
+	py_convert(L, PySequence_Fast_GET_ITEM(o, i), 1);
+	return 1;
+}
 
-        m = PyImport_AddModule("__main__");
-        if (!m) {
-		free(buffer);
-		luaL_error(L, "Can't get __main__ module");
+/* Iteration step over a dict. Upvalues: object, PyDict_Next position,
+ * size at start, whether to return (key, value) pairs. */
+static int py_iter_dict(lua_State *L)
+{
+	PyObject *o = check_py_object(L, lua_upvalueindex(1))->o;
+	Py_ssize_t pos = (Py_ssize_t)lua_tointeger(L, lua_upvalueindex(2));
+	PyObject *key, *value;
+
+	if (PyDict_Size(o) != (Py_ssize_t)lua_tointeger(L, lua_upvalueindex(3))) {
+		luaL_error(L, "dictionary changed size during iteration");
 		return 0;
 	}
-        d = PyModule_GetDict(m);
-
-        o = PyRun_StringFlags(s, eval ? Py_eval_input : Py_single_input,
-			      d, d, NULL);
-
-	free(buffer);
-
-        if (!o) {
-                PyErr_Print();
+	if (!PyDict_Next(o, &pos, &key, &value))
 		return 0;
-        }
-
-	if (py_convert(L, o, 0))
-		ret = 1;
+	lua_pushinteger(L, pos);
+	lua_replace(L, lua_upvalueindex(2));
 
-	Py_DECREF(o);
-
-        if (Py_FlushLine())
-                PyErr_Clear();
-
-	return ret;
+	py_convert(L, key, 1);
+	if (lua_toboolean(L, lua_upvalueindex(4))) {
+		py_convert(L, value, 0);
+		return 2;
+	}
+	return 1;
 }
 
-static int py_execute(lua_State *L)
+/* Iteration step over any other iterable, streaming from its iterator.
+ * Upvalues: iterator, item count, whether to return (count, value)
+ * pairs. */
+static int py_iter_generic(lua_State *L)
 {
-	return py_run(L, 0);
-}
+	PyObject *it = check_py_object(L, lua_upvalueindex(1))->o;
+	PyObject *item = PyIter_Next(it);
+	lua_Integer n;
 
-static int py_eval(lua_State *L)
-{
-	return py_run(L, 1);
+	if (!item) {
+		if (PyErr_Occurred()) {
+			py_error(L, "error iterating python object");
+		}
+		return 0;
+	}
+
+	if (lua_toboolean(L, lua_upvalueindex(3))) {
+		n = lua_tointeger(L, lua_upvalueindex(2));
+		lua_pushinteger(L, n+1);
+		lua_replace(L, lua_upvalueindex(2));
+		lua_pushinteger(L, n);
+		py_convert(L, item, 0);
+		Py_DECREF(item);
+		return 2;
+	}
+	py_convert(L, item, 1);
+	Py_DECREF(item);
+	return 1;
 }
 
-static int py_asindx(lua_State *L)
+/* Push an iteration function over the python object at index 1, for
+ * use in a generic for. Single values are converted with None as
+ * python.none, so they don't end the loop. */
+static int py_iter_push(lua_State *L, int items)
+{
+	py_object *obj = check_py_object(L, 1);
+
+	if (!obj) {
+		luaL_argerror(L, 1, "not a python object");
+		return 0;
+	}
+
+	if (PyList_Check(obj->o) || PyTuple_Check(obj->o)) {
+		lua_pushvalue(L, 1);
+		lua_pushinteger(L, 0);
+		lua_pushboolean(L, items);
+		lua_pushcclosure(L, py_iter_seq, 3);
+	} else if (PyDict_Check(obj->o)) {
+		lua_pushvalue(L, 1);
+		lua_pushinteger(L, 0);
+		lua_pushinteger(L, PyDict_Size(obj->o));
+		lua_pushboolean(L, items);
+		lua_pushcclosure(L, py_iter_dict, 4);
+	} else {
+		PyObject *it = PyObject_GetIter(obj->o);
+		if (!it) {
+			py_error(L, "python object is not iterable");
+			return 0;
+		}
+		py_convert_custom(L, it, 0);
+		Py_DECREF(it);
+		lua_pushinteger(L, 0);
+		lua_pushboolean(L, items);
+		lua_pushcclosure(L, py_iter_generic, 3);
+	}
+	return 1;
+}
+
+/**
+ * python.iter(obj) - iterate over the values of a Python iterable (the
+ * keys of a dict) with a generic for.
+ */
+static int py_iter(lua_State *L)
+{
+	return py_iter_push(L, 0);
+}
+
+/**
+ * python.items(obj) - iterate over (key, value) pairs of a dict, or
+ * (index, value) pairs of other iterables, with 0-based Python indexes.
+ */
+static int py_items(lua_State *L)
+{
+	return py_iter_push(L, 1);
+}
+
+#define PY_SNAPSHOT_MAXDEPTH 64
+
+/* Replace the table on top of the stack with a frozen proxy over it. */
+static void py_frozen_wrap(lua_State *L)
+{
+	((py_frozen *)lua_newuserdata(L, sizeof(py_frozen)))->frozen = NULL;
+	luaL_getmetatable(L, PFROZEN);
+	lua_setmetatable(L, -2);
+	lua_insert(L, -2);
+	lua_setfenv(L, -2);
+}
+
+/* Push a read-only copy of the dict, list or tuple 'o', as a frozen
+ * table; with 'deep', nested containers are copied too. */
+static void py_snapshot_build(lua_State *L, PyObject *o, int deep, int depth)
+{
+	if (depth > PY_SNAPSHOT_MAXDEPTH)
+		luaL_error(L, "python object too deep to snapshot");
+	luaL_checkstack(L, 4, "python object too deep to snapshot");
+
+	if (PyDict_Check(o)) {
+		Py_ssize_t pos = 0;
+		PyObject *key, *value;
+		lua_createtable(L, 0, (int)PyDict_Size(o));
+		while (PyDict_Next(o, &pos, &key, &value)) {
+			py_convert(L, key, 1);
+			if (deep && (PyDict_Check(value) || PyList_Check(value) ||
+				     PyTuple_Check(value)))
+				py_snapshot_build(L, value, deep, depth+1);
+			else
+				py_convert(L, value, 0);
+			lua_rawset(L, -3);
+		}
+	} else {
+		Py_ssize_t i, n = PySequence_Fast_GET_SIZE(o);
+		lua_createtable(L, (int)n, 0);
+		for (i = 0; i != n; i++) {
+			PyObject *value = PySequence_Fast_GET_ITEM(o, i);
+			if (deep && (PyDict_Check(value) || PyList_Check(value) ||
+				     PyTuple_Check(value)))
+				py_snapshot_build(L, value, deep, depth+1);
+			else
+				py_convert(L, value, 0);
+			lua_rawseti(L, -2, (int)i+1);
+		}
+	}
+	py_frozen_wrap(L);
+}
+
+/* Snapshots are cached in two generations of up to PY_SNAPSHOT_CACHE
+ * entries each, like compiled code. Entries hold their object, so its
+ * address can't be reused while cached, and the generations bound how
+ * many objects are kept alive that way. */
+#define PY_SNAPSHOT_CACHE 64
+
+/* Push the snapshot cache: {young, old, count} */
+static void py_snapshot_cache(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, PSNAPSHOTS);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, 3, 0);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+		lua_pushinteger(L, 0);
+		lua_rawseti(L, -2, 3);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, PSNAPSHOTS);
+	}
+}
+
+/* Store the entry on top of the stack as the young entry for 'o', in the
+ * cache at 'cache'. Pops the entry. */
+static void py_snapshot_put(lua_State *L, int cache, PyObject *o)
+{
+	int count;
+	lua_rawgeti(L, cache, 3);
+	count = (int)lua_tointeger(L, -1) + 1;
+	lua_pop(L, 1);
+	if (count > PY_SNAPSHOT_CACHE) {
+		lua_rawgeti(L, cache, 1);
+		lua_rawseti(L, cache, 2);
+		lua_newtable(L);
+		lua_rawseti(L, cache, 1);
+		count = 1;
+	}
+	lua_pushinteger(L, count);
+	lua_rawseti(L, cache, 3);
+	lua_rawgeti(L, cache, 1);
+	lua_pushlightuserdata(L, o);
+	lua_pushvalue(L, -3);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+}
+
+/**
+ * python.snapshot(obj [, deep]) - return a frozen table (see
+ * python.freeze) with the contents of a dict, list or tuple (lists and
+ * tuples as 1-based arrays), so hot reads don't cross into Python.
+ * Since it is shared between callers, it can't be written to, which
+ * would leave it out of step with 'obj'. The table is memoized
+ * per object and rebuilt when the object is known to have changed:
+ * its length differs, it was written through the bridge, or it was
+ * invalidated with LuaState.invalidate(). Python 2 dicts carry no
+ * version tag, so in-place updates made from Python must be announced
+ * that way. With 'deep', nested containers are copied as well, but only
+ * changes to 'obj' itself are tracked. Only the last 64 to 128 objects
+ * snapshotted are remembered (and kept alive).
+ */
+static int py_snapshot(lua_State *L)
+{
+	py_object *obj = check_py_object(L, 1);
+	int deep = lua_toboolean(L, 2);
+	Py_ssize_t len;
+
+	if (!obj || !(PyDict_Check(obj->o) || PyList_Check(obj->o) ||
+		      PyTuple_Check(obj->o))) {
+		luaL_argerror(L, 1, "python dict, list or tuple expected");
+		return 0;
+	}
+	len = PyDict_Check(obj->o) ? PyDict_Size(obj->o)
+				   : PySequence_Fast_GET_SIZE(obj->o);
+
+	lua_settop(L, 2);
+	py_snapshot_cache(L);
+
+	/* Entries are {object, snapshot, length, deep}; old ones found
+	 * valid are moved back to the young generation */
+	lua_rawgeti(L, 3, 1);
+	lua_pushlightuserdata(L, obj->o);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 2);
+		lua_rawgeti(L, 3, 2);
+		lua_pushlightuserdata(L, obj->o);
+		lua_rawget(L, -2);
+	}
+	if (lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 3);
+		lua_rawgeti(L, -2, 4);
+		if (lua_tointeger(L, -2) == len && lua_toboolean(L, -1) == deep) {
+			lua_pop(L, 2);
+			lua_pushvalue(L, -1);
+			py_snapshot_put(L, 3, obj->o);
+			lua_rawgeti(L, -1, 2);
+			return 1;
+		}
+	}
+	lua_settop(L, 3);
+
+	lua_createtable(L, 4, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	py_snapshot_build(L, obj->o, deep, 0);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -3, 2);
+	lua_pushinteger(L, len);
+	lua_rawseti(L, -3, 3);
+	lua_pushboolean(L, deep);
+	lua_rawseti(L, -3, 4);
+	lua_insert(L, -2);
+	py_snapshot_put(L, 3, obj->o);
+	return 1;
+}
+
+static const luaL_reg py_object_lib[] = {
+	{"__call",	py_object_call},
+	{"__index",	py_object_index},
+	{"__newindex",	py_object_newindex},
+	{"__gc",	py_object_gc},
+	{"__tostring",	py_object_tostring},
+	{NULL, NULL}
+};
+
+/**
+ * Get a buffer over the memory of 'o', preferring a writable one when
+ * 'wantwrite' is set. Objects only implementing the old buffer protocol
+ * (array, mmap) are supported too, but their memory isn't pinned: call
+ * py_buffer_refresh() before each use. view->readonly tells what was
+ * obtained; view->format is the exporter's item format, and NULL for
+ * old style buffers.
+ */
+int py_getbuffer(PyObject *o, Py_buffer *view, int wantwrite)
+{
+	void *buf;
+	Py_ssize_t len;
+
+	if (PyObject_CheckBuffer(o)) {
+		if (wantwrite) {
+			if (PyObject_GetBuffer(o, view, PyBUF_WRITABLE|PyBUF_FORMAT) == 0)
+				return 0;
+			PyErr_Clear();
+		}
+		return PyObject_GetBuffer(o, view, PyBUF_FORMAT);
+	}
+
+	if (wantwrite) {
+		if (PyObject_AsWriteBuffer(o, &buf, &len) == 0)
+			return PyBuffer_FillInfo(view, o, buf, len, 0, PyBUF_SIMPLE);
+		PyErr_Clear();
+	}
+	if (PyObject_AsReadBuffer(o, (const void **)&buf, &len) == 0)
+		return PyBuffer_FillInfo(view, o, buf, len, 1, PyBUF_SIMPLE);
+	return -1;
+}
+
+/**
+ * Old style buffers may be resized, moving their memory, while a view
+ * holds them; get their pointer and length again. New style buffers
+ * are locked by the export and left alone.
+ */
+int py_buffer_refresh(Py_buffer *view)
+{
+	void *buf;
+	Py_ssize_t len;
+	int rc;
+
+	if (PyObject_CheckBuffer(view->obj))
+		return 0;
+	if (view->readonly)
+		rc = PyObject_AsReadBuffer(view->obj, (const void **)&buf, &len);
+	else
+		rc = PyObject_AsWriteBuffer(view->obj, &buf, &len);
+	if (rc == -1)
+		return -1;
+	view->buf = buf;
+	view->len = len;
+	return 0;
+}
+
+/* luaL_checkudata for views, with the buffer refreshed */
+static py_view *py_view_check(lua_State *L, int ud, const char *tname)
+{
+	py_view *v = (py_view *) luaL_checkudata(L, ud, tname);
+	if (py_buffer_refresh(&v->view) == -1)
+		py_error(L, "failed to get python view buffer");
+	v->len = v->view.len / v->itemsize;
+	return v;
+}
+
+Py_ssize_t py_view_itemsize(char fmt)
+{
+	switch (fmt) {
+		case 'b': case 'B': return sizeof(char);
+		case 'h': case 'H': return sizeof(short);
+		case 'i': case 'I': return sizeof(int);
+		case 'l': case 'L': return sizeof(long);
+		case 'q': case 'Q': return sizeof(long long);
+		case 'f': return sizeof(float);
+		case 'd': return sizeof(double);
+	}
+	return 0;
+}
+
+#define VIEW_GET(type) { type v; memcpy(&v, p, sizeof(v)); \
+			 lua_pushnumber(L, (lua_Number)v); break; }
+/* Integers are truncated like lua_tointeger, but must fit the type:
+ * converting anything else (or NaN) to it is undefined. */
+#define VIEW_SETINT(type, lo, hi) { type v; \
+			 lua_Number t = n < 0 ? ceil(n) : floor(n); \
+			 if (!(t >= (lua_Number)(lo) && t < (lua_Number)(hi) + 1)) \
+				 return -1; \
+			 v = (type)t; memcpy(p, &v, sizeof(v)); return 0; }
+
+void py_view_push(lua_State *L, char fmt, const char *p)
+{
+	switch (fmt) {
+		case 'b': VIEW_GET(signed char)
+		case 'B': VIEW_GET(unsigned char)
+		case 'h': VIEW_GET(short)
+		case 'H': VIEW_GET(unsigned short)
+		case 'i': VIEW_GET(int)
+		case 'I': VIEW_GET(unsigned int)
+		case 'l': VIEW_GET(long)
+		case 'L': VIEW_GET(unsigned long)
+		case 'q': VIEW_GET(long long)
+		case 'Q': VIEW_GET(unsigned long long)
+		case 'f': VIEW_GET(float)
+		case 'd': VIEW_GET(double)
+	}
+}
+
+/**
+ * Store 'n' as an item of format 'fmt' at 'p'. Returns -1, storing
+ * nothing, when 'n' is out of the range of the format.
+ */
+int py_view_store(char fmt, char *p, lua_Number n)
+{
+	switch (fmt) {
+		case 'b': VIEW_SETINT(signed char, SCHAR_MIN, SCHAR_MAX)
+		case 'B': VIEW_SETINT(unsigned char, 0, UCHAR_MAX)
+		case 'h': VIEW_SETINT(short, SHRT_MIN, SHRT_MAX)
+		case 'H': VIEW_SETINT(unsigned short, 0, USHRT_MAX)
+		case 'i': VIEW_SETINT(int, INT_MIN, INT_MAX)
+		case 'I': VIEW_SETINT(unsigned int, 0, UINT_MAX)
+		case 'l': VIEW_SETINT(long, LONG_MIN, LONG_MAX)
+		case 'L': VIEW_SETINT(unsigned long, 0, ULONG_MAX)
+		case 'q': VIEW_SETINT(long long, LLONG_MIN, LLONG_MAX)
+		case 'Q': VIEW_SETINT(unsigned long long, 0, ULLONG_MAX)
+		case 'f': {
+			float v;
+			/* Infinities and NaN convert; finite overflow doesn't */
+			if ((n > FLT_MAX && n <= DBL_MAX) ||
+			    (n < -FLT_MAX && n >= -DBL_MAX))
+				return -1;
+			v = (float)n;
+			memcpy(p, &v, sizeof(v));
+			return 0;
+		}
+		case 'd': {
+			double v = (double)n;
+			memcpy(p, &v, sizeof(v));
+			return 0;
+		}
+	}
+	return -1;
+}
+
+#undef VIEW_GET
+#undef VIEW_SETINT
+
+static int py_view_index(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PVIEW);
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		lua_Integer i = lua_tointeger(L, 2);
+		if (i >= 1 && i <= v->len) {
+			py_view_push(L, v->fmt,
+				     (char *)v->view.buf + (i-1)*v->itemsize);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int py_view_newindex(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PVIEW);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	lua_Number n = luaL_checknumber(L, 3);
+
+	if (v->view.readonly) {
+		luaL_error(L, "python view is read-only");
+		return 0;
+	}
+	if (i < 1 || i > v->len) {
+		luaL_error(L, "python view index out of range");
+		return 0;
+	}
+	if (py_view_store(v->fmt, (char *)v->view.buf + (i-1)*v->itemsize, n) == -1)
+		luaL_error(L, "value out of range for python view format '%c'",
+			   v->fmt);
+	return 0;
+}
+
+static int py_view_len(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PVIEW);
+	lua_pushinteger(L, v->len);
+	return 1;
+}
+
+static int py_view_gc(lua_State *L)
+{
+	py_view *v = check_py_view(L, 1);
+	if (v)
+		PyBuffer_Release(&v->view);
+	return 0;
+}
+
+static int py_view_tostring(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PVIEW);
+	lua_pushfstring(L, "python view '%c' [%d]: %p",
+			v->fmt, (int)v->len, v->view.obj);
+	return 1;
+}
+
+static const luaL_reg py_view_lib[] = {
+	{"__index",	py_view_index},
+	{"__newindex",	py_view_newindex},
+	{"__len",	py_view_len},
+	{"__gc",	py_view_gc},
+	{"__tostring",	py_view_tostring},
+	{NULL, NULL}
+};
+
+/* Same as in lstrlib.c: relative string position, negative means back
+ * from end. */
+static ptrdiff_t posrelat(ptrdiff_t pos, size_t len)
+{
+	if (pos < 0) pos += (ptrdiff_t)len + 1;
+	return (pos >= 0) ? pos : 0;
+}
+
+static const char *py_memfind(const char *s1, size_t l1,
+			      const char *s2, size_t l2)
+{
+	if (l2 == 0)
+		return s1;
+	else if (l2 > l1)
+		return NULL;
+	else {
+		const char *init;
+		l2--;
+		l1 = l1-l2;
+		while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
+			init++;
+			if (memcmp(init, s2+1, l2) == 0)
+				return init-1;
+			l1 -= init-s1;
+			s1 = init;
+		}
+		return NULL;
+	}
+}
+
+static int py_strview_len(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PSTRVIEW);
+	lua_pushinteger(L, v->len);
+	return 1;
+}
+
+static int py_strview_sub(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PSTRVIEW);
+	size_t l = (size_t)v->len;
+	ptrdiff_t start = posrelat(luaL_checkinteger(L, 2), l);
+	ptrdiff_t end = posrelat(luaL_optinteger(L, 3, -1), l);
+	if (start < 1) start = 1;
+	if (end > (ptrdiff_t)l) end = (ptrdiff_t)l;
+	if (start <= end)
+		lua_pushlstring(L, (char *)v->view.buf+start-1, end-start+1);
+	else
+		lua_pushliteral(L, "");
+	return 1;
+}
+
+static int py_strview_byte(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PSTRVIEW);
+	size_t l = (size_t)v->len;
+	const unsigned char *s = (const unsigned char *)v->view.buf;
+	ptrdiff_t posi = posrelat(luaL_optinteger(L, 2, 1), l);
+	ptrdiff_t pose = posrelat(luaL_optinteger(L, 3, posi), l);
+	int n, i;
+	if (posi <= 0) posi = 1;
+	if ((size_t)pose > l) pose = l;
+	if (posi > pose) return 0;
+	n = (int)(pose - posi + 1);
+	if (posi + n <= pose)	/* overflow? */
+		luaL_error(L, "string slice too long");
+	luaL_checkstack(L, n, "string slice too long");
+	for (i = 0; i < n; i++)
+		lua_pushinteger(L, s[posi+i-1]);
+	return n;
+}
+
+/* Plain substring search only; there is no pattern matching on views. */
+static int py_strview_find(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PSTRVIEW);
+	size_t l1 = (size_t)v->len, l2;
+	const char *s = (const char *)v->view.buf;
+	const char *p = luaL_checklstring(L, 2, &l2);
+	ptrdiff_t init = posrelat(luaL_optinteger(L, 3, 1), l1) - 1;
+	const char *s2;
+	if (init < 0) init = 0;
+	else if ((size_t)init > l1) init = (ptrdiff_t)l1;
+	s2 = py_memfind(s+init, l1-init, p, l2);
+	if (s2) {
+		lua_pushinteger(L, s2-s+1);
+		lua_pushinteger(L, s2-s+l2);
+		return 2;
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int py_strview_gc(lua_State *L)
+{
+	py_view *v = check_py_strview(L, 1);
+	if (v)
+		PyBuffer_Release(&v->view);
+	return 0;
+}
+
+static int py_strview_tostring(lua_State *L)
+{
+	py_view *v = py_view_check(L, 1, PSTRVIEW);
+	lua_pushfstring(L, "python string view [%d]: %p",
+			(int)v->len, v->view.obj);
+	return 1;
+}
+
+static const luaL_reg py_strview_lib[] = {
+	{"__len",	py_strview_len},
+	{"__gc",	py_strview_gc},
+	{"__tostring",	py_strview_tostring},
+	{NULL, NULL}
+};
+
+static const luaL_reg py_strview_methods[] = {
+	{"len",		py_strview_len},
+	{"sub",		py_strview_sub},
+	{"byte",	py_strview_byte},
+	{"find",	py_strview_find},
+	{NULL, NULL}
+};
+
+/* out:write(...) - append strings and numbers to the sink, like io.write */
+static int py_sink_write(lua_State *L)
+{
+	LuaSinkObject *sink = *(LuaSinkObject **) luaL_checkudata(L, 1, PSINK);
+	int nargs = lua_gettop(L);
+	int i;
+
+	for (i = 2; i <= nargs; i++) {
+		size_t len;
+		const char *s = luaL_checklstring(L, i, &len);
+		if (LuaSink_append(sink, s, len) == -1) {
+			py_error(L, "failed to write to sink");
+			return 0;
+		}
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int py_sink_len(lua_State *L)
+{
+	LuaSinkObject *sink = *(LuaSinkObject **) luaL_checkudata(L, 1, PSINK);
+	lua_pushinteger(L, sink->len);
+	return 1;
+}
+
+static int py_sink_gc(lua_State *L)
+{
+	PyObject *sink = check_py_sink(L, 1);
+	Py_XDECREF(sink);
+	return 0;
+}
+
+static int py_sink_tostring(lua_State *L)
+{
+	PyObject *sink = check_py_sink(L, 1);
+	lua_pushfstring(L, "python sink: %p", sink);
+	return 1;
+}
+
+static const luaL_reg py_sink_lib[] = {
+	{"__len",	py_sink_len},
+	{"__gc",	py_sink_gc},
+	{"__tostring",	py_sink_tostring},
+	{NULL, NULL}
+};
+
+static const luaL_reg py_sink_methods[] = {
+	{"write",	py_sink_write},
+	{NULL, NULL}
+};
+
+#define check_numarray(L, n) \
+	(*(LuaNumArrayObject **) luaL_checkudata(L, n, PNUMARRAY))
+
+static int py_numarray_index(lua_State *L)
+{
+	LuaNumArrayObject *a = check_numarray(L, 1);
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		lua_Integer i = lua_tointeger(L, 2);
+		if (i >= 1 && i <= a->len) {
+			py_view_push(L, a->fmt[0], a->data + (i-1)*a->itemsize);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+static int py_numarray_newindex(lua_State *L)
+{
+	LuaNumArrayObject *a = check_numarray(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	lua_Number n = luaL_checknumber(L, 3);
+
+	if (i < 1 || i > a->len) {
+		luaL_error(L, "python numarray index out of range");
+		return 0;
+	}
+	if (py_view_store(a->fmt[0], a->data + (i-1)*a->itemsize, n) == -1)
+		luaL_error(L, "value out of range for python numarray format '%c'",
+			   a->fmt[0]);
+	return 0;
+}
+
+static int py_numarray_len(lua_State *L)
+{
+	lua_pushinteger(L, check_numarray(L, 1)->len);
+	return 1;
+}
+
+static int py_numarray_gc(lua_State *L)
+{
+	PyObject *a = check_py_numarray(L, 1);
+	Py_XDECREF(a);
+	return 0;
+}
+
+static int py_numarray_tostring(lua_State *L)
+{
+	LuaNumArrayObject *a = check_numarray(L, 1);
+	lua_pushfstring(L, "python numarray '%c' [%d]: %p",
+			a->fmt[0], (int)a->len, a);
+	return 1;
+}
+
+static const luaL_reg py_numarray_lib[] = {
+	{"__index",	py_numarray_index},
+	{"__newindex",	py_numarray_newindex},
+	{"__len",	py_numarray_len},
+	{"__gc",	py_numarray_gc},
+	{"__tostring",	py_numarray_tostring},
+	{NULL, NULL}
+};
+
+#undef check_numarray
+
+/* Struct format of the ctypes type of a field, or 0 when the field
+ * can't be accessed in place: bit fields, non-native byte order, and
+ * types views don't support (arrays, pointers, nested structures). */
+static char py_struct_format(PyObject *ctype, int bitfield)
+{
+	static const int one = 1;
+	const char *order = *(const char *)&one ? "__ctype_le__" : "__ctype_be__";
+	PyObject *code, *native;
+	char fmt = 0;
+
+	if (bitfield)
+		return 0;
+	code = PyObject_GetAttrString(ctype, "_type_");
+	if (code && PyString_Check(code) && PyString_GET_SIZE(code) == 1)
+		fmt = PyString_AS_STRING(code)[0];
+	Py_XDECREF(code);
+	native = PyObject_GetAttrString(ctype, order);
+	if (native && native != ctype)
+		fmt = 0;
+	Py_XDECREF(native);
+	PyErr_Clear();
+	return py_view_itemsize(fmt) ? fmt : 0;
+}
+
+/* Add the fields of a _fields_ sequence of 'type' to the layout on top */
+static int py_struct_addfields(lua_State *L, PyObject *type, PyObject *fields)
+{
+	PyObject *seq, *field, *name, *descr, *attr;
+	Py_ssize_t i, n, offset, size;
+	char fmt;
+
+	seq = PySequence_Fast(fields, "_fields_ must be a sequence");
+	if (!seq)
+		return -1;
+	n = PySequence_Fast_GET_SIZE(seq);
+	for (i = 0; i != n; i++) {
+		field = PySequence_Fast_GET_ITEM(seq, i);
+		if (!PyTuple_Check(field) || PyTuple_GET_SIZE(field) < 2 ||
+		    !PyString_Check(PyTuple_GET_ITEM(field, 0))) {
+			PyErr_SetString(PyExc_TypeError, "invalid _fields_ entry");
+			goto error;
+		}
+		name = PyTuple_GET_ITEM(field, 0);
+		fmt = py_struct_format(PyTuple_GET_ITEM(field, 1),
+				       PyTuple_GET_SIZE(field) > 2);
+		offset = size = -1;
+		descr = PyObject_GetAttr(type, name);
+		if (!descr)
+			goto error;
+		attr = PyObject_GetAttrString(descr, "offset");
+		if (attr) {
+			offset = PyInt_AsSsize_t(attr);
+			Py_DECREF(attr);
+		}
+		attr = PyObject_GetAttrString(descr, "size");
+		if (attr) {
+			size = PyInt_AsSsize_t(attr);
+			Py_DECREF(attr);
+		}
+		Py_DECREF(descr);
+		PyErr_Clear();
+
+		lua_pushlstring(L, PyString_AS_STRING(name),
+				PyString_GET_SIZE(name));
+		if (fmt && offset >= 0 && size == py_view_itemsize(fmt))
+			lua_pushnumber(L, (lua_Number)offset * 256 + fmt);
+		else
+			lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+	}
+	Py_DECREF(seq);
+	return 0;
+  error:
+	Py_DECREF(seq);
+	return -1;
+}
+
+/**
+ * Push the layout of ctypes structure type 'type': a table mapping each
+ * field name to offset*256 + format for fields read in place, or to
+ * true for fields read through Python. Layouts keep their type alive at
+ * [0], and are cached per type in a weak valued registry table: the
+ * cache holds a layout, and so its type, only while structures using it
+ * are alive in Lua.
+ */
+static void py_struct_layout(lua_State *L, PyObject *type)
+{
+	PyObject *mro, *fields;
+	Py_ssize_t i;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, PSTRUCTS);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_createtable(L, 0, 1);
+		lua_pushliteral(L, "v");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, PSTRUCTS);
+	}
+	lua_pushlightuserdata(L, type);
+	lua_rawget(L, -2);
+	if (!lua_isnil(L, -1)) {
+		lua_remove(L, -2);
+		return;
+	}
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	py_convert_custom(L, type, 0);
+	lua_rawseti(L, -2, 0);
+
+	/* Bases first, so fields redefined by subclasses win */
+	mro = PyObject_GetAttrString(type, "__mro__");
+	if (!mro || !PyTuple_Check(mro)) {
+		Py_XDECREF(mro);
+		py_error(L, "failed to read structure layout");
+		return;
+	}
+	for (i = PyTuple_GET_SIZE(mro) - 1; i >= 0; i--) {
+		PyObject *cls = PyTuple_GET_ITEM(mro, i);
+		if (!PyType_Check(cls))
+			continue;
+		fields = PyDict_GetItemString(((PyTypeObject *)cls)->tp_dict,
+					      "_fields_");
+		if (fields && py_struct_addfields(L, type, fields) == -1) {
+			Py_DECREF(mro);
+			py_error(L, "failed to read structure layout");
+			return;
+		}
+	}
+	Py_DECREF(mro);
+
+	lua_pushlightuserdata(L, type);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	lua_remove(L, -2);
+}
+
+/* Look up field 2 of the structure at 1 in its layout. Returns the
+ * address for fields read in place, else NULL with true (a field read
+ * through Python) or nil on top of the stack. */
+static char *py_struct_field(lua_State *L, py_struct *s, char *fmt)
+{
+	lua_Number code;
+	Py_ssize_t offset;
+
+	if (lua_type(L, 2) != LUA_TSTRING) {
+		lua_pushnil(L);
+		return NULL;
+	}
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	if (lua_type(L, -1) != LUA_TNUMBER)
+		return NULL;
+	code = lua_tonumber(L, -1);
+	offset = (Py_ssize_t)(code / 256);
+	*fmt = (char)(code - (lua_Number)offset * 256);
+	if (offset + py_view_itemsize(*fmt) > s->view.len)
+		luaL_error(L, "python struct buffer is too small");
+	return (char *)s->view.buf + offset;
+}
+
+static int py_struct_index(lua_State *L)
+{
+	py_struct *s = (py_struct *) luaL_checkudata(L, 1, PSTRUCT);
+	PyObject *value;
+	char fmt, *p = py_struct_field(L, s, &fmt);
+
+	if (p) {
+		py_view_push(L, fmt, p);
+		return 1;
+	}
+	/* Other fields, methods and properties come from Python */
+	if (lua_type(L, 2) != LUA_TSTRING)
+		return 1;
+	value = PyObject_GetAttrString(s->view.obj, lua_tostring(L, 2));
+	if (!value)
+		return py_error(L, "failed to get structure attribute");
+	py_convert(L, value, 0);
+	Py_DECREF(value);
+	return 1;
+}
+
+static int py_struct_newindex(lua_State *L)
+{
+	py_struct *s = (py_struct *) luaL_checkudata(L, 1, PSTRUCT);
+	PyObject *value;
+	char fmt, *p;
+	int rc;
+
+	if (s->view.readonly)
+		return luaL_error(L, "python struct is read-only");
+	p = py_struct_field(L, s, &fmt);
+	if (p) {
+		if (py_view_store(fmt, p, luaL_checknumber(L, 3)) == -1)
+			return luaL_error(L, "value out of range for field '%s'",
+					  lua_tostring(L, 2));
+		return 0;
+	}
+	if (!lua_toboolean(L, -1))
+		return luaL_error(L, "python struct has no field '%s'",
+				  lua_tostring(L, 2));
+	value = LuaConvertPy(L, 3);
+	if (!value)
+		return py_error(L, "failed to convert value");
+	rc = PyObject_SetAttrString(s->view.obj, lua_tostring(L, 2), value);
+	Py_DECREF(value);
+	if (rc == -1)
+		return py_error(L, "failed to set structure field");
+	return 0;
+}
+
+static int py_struct_gc(lua_State *L)
+{
+	py_struct *s = check_py_struct(L, 1);
+	if (s)
+		PyBuffer_Release(&s->view);
+	return 0;
+}
+
+static int py_struct_tostring(lua_State *L)
+{
+	py_struct *s = (py_struct *) luaL_checkudata(L, 1, PSTRUCT);
+	lua_pushfstring(L, "python struct: %p", s->view.obj);
+	return 1;
+}
+
+static const luaL_reg py_struct_lib[] = {
+	{"__index",	py_struct_index},
+	{"__newindex",	py_struct_newindex},
+	{"__gc",	py_struct_gc},
+	{"__tostring",	py_struct_tostring},
+	{NULL, NULL}
+};
+
+/**
+ * python.struct(obj) - fast field access to the ctypes structure 'obj'.
+ * Fields of simple numeric types are read and written directly in its
+ * memory, at offsets taken once per structure type; other fields and
+ * attributes go through Python attribute access.
+ */
+static int py_struct_new(lua_State *L)
+{
+	py_object *obj = check_py_object(L, 1);
+	py_struct *s;
+
+	if (!obj)
+		return luaL_argerror(L, 1, "not a python object");
+	if (!PyObject_HasAttrString((PyObject *)Py_TYPE(obj->o), "_fields_"))
+		return luaL_argerror(L, 1, "ctypes structure expected");
+	lua_settop(L, 1);
+	py_struct_layout(L, (PyObject *)Py_TYPE(obj->o));
+
+	s = (py_struct *) lua_newuserdata(L, sizeof(py_struct));
+	if (py_getbuffer(obj->o, &s->view, 1) == -1)
+		return py_error(L, "object does not support the buffer protocol");
+	luaL_getmetatable(L, PSTRUCT);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 2);
+	lua_setfenv(L, -2);
+	return 1;
+}
+
+static int py_frozen_index(lua_State *L)
+{
+	luaL_checkudata(L, 1, PFROZEN);
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, -2);
+	return 1;
+}
+
+static int py_frozen_newindex(lua_State *L)
+{
+	return luaL_error(L, "attempt to modify a frozen table");
+}
+
+static int py_frozen_len(lua_State *L)
+{
+	luaL_checkudata(L, 1, PFROZEN);
+	lua_getfenv(L, 1);
+	lua_pushinteger(L, lua_objlen(L, -1));
+	return 1;
+}
+
+/* t() - iterate over a frozen table, like pairs(t) */
+static int py_frozen_call(lua_State *L)
+{
+	luaL_checkudata(L, 1, PFROZEN);
+	lua_getglobal(L, "next");
+	lua_getfenv(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int py_frozen_tostring(lua_State *L)
+{
+	lua_pushfstring(L, "frozen table: %p", luaL_checkudata(L, 1, PFROZEN));
+	return 1;
+}
+
+static const luaL_reg py_frozen_lib[] = {
+	{"__index",	py_frozen_index},
+	{"__newindex",	py_frozen_newindex},
+	{"__len",	py_frozen_len},
+	{"__call",	py_frozen_call},
+	{"__tostring",	py_frozen_tostring},
+	{NULL, NULL}
+};
+
+/* Push the frozen proxy of the table at 't', reusing the proxies already
+ * made for tables in the 'seen' table, so shared and cyclic tables stay
+ * shared. */
+static void py_freeze_table(lua_State *L, int t, int seen)
+{
+	int backing;
+
+	lua_pushvalue(L, t);
+	lua_rawget(L, seen);
+	if (!lua_isnil(L, -1))
+		return;
+	lua_pop(L, 1);
+
+	luaL_checkstack(L, 6, "table too deep to freeze");
+	((py_frozen *)lua_newuserdata(L, sizeof(py_frozen)))->frozen = NULL;
+	luaL_getmetatable(L, PFROZEN);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, t);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, seen);
+
+	lua_newtable(L);
+	backing = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, t)) {
+		if (lua_istable(L, -1)) {
+			py_freeze_table(L, lua_gettop(L), seen);
+			lua_replace(L, -2);
+		}
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, backing);
+	}
+	lua_setfenv(L, -2);
+}
+
+/**
+ * python.freeze(t) - read-only proxy over a copy of table 't', with
+ * nested tables frozen as well. Writes through the proxy raise errors;
+ * 't' itself is left alone. The proxy is a userdata, so Lua 5.1's
+ * pairs and next can't walk it: calling it iterates instead.
+ */
+int py_freeze(lua_State *L)
+{
+	if (check_udata(L, 1, PFROZEN)) {
+		lua_settop(L, 1);
+		return 1;
+	}
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_newtable(L);
+	py_freeze_table(L, 1, 2);
+	return 1;
+}
+
+/* Compiled code objects are cached per Lua state, keyed by the source
+ * string, in two generations of up to PY_CODECACHE_SIZE entries each:
+ * when the young generation fills up it becomes the old one, and hits
+ * in the old generation are promoted back. This keeps recently used
+ * code around with O(1) lookups on Lua's own string hash. */
+#define PCODECACHE "PyCodeCache"
+#define PY_CODECACHE_SIZE 64
+
+/* Push the cache table for 'mode': {young, old, count} */
+static void py_code_cache(lua_State *L, int mode)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, PCODECACHE);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, PCODECACHE);
+	}
+	lua_rawgeti(L, -1, mode);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_createtable(L, 3, 0);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 1);
+		lua_newtable(L);
+		lua_rawseti(L, -2, 2);
+		lua_pushinteger(L, 0);
+		lua_rawseti(L, -2, 3);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, mode);
+	}
+	lua_remove(L, -2);
+}
+
+/* Store the value on top of the stack as the young entry for the source
+ * at 'src', in the cache table at 'cache'. Pops the value. */
+static void py_code_cache_put(lua_State *L, int cache, int src)
+{
+	int count;
+	lua_rawgeti(L, cache, 3);
+	count = (int)lua_tointeger(L, -1) + 1;
+	lua_pop(L, 1);
+	if (count > PY_CODECACHE_SIZE) {
+		lua_rawgeti(L, cache, 1);
+		lua_rawseti(L, cache, 2);
+		lua_newtable(L);
+		lua_rawseti(L, cache, 1);
+		count = 1;
+	}
+	lua_pushinteger(L, count);
+	lua_rawseti(L, cache, 3);
+	lua_rawgeti(L, cache, 1);
+	lua_pushvalue(L, src);
+	lua_pushvalue(L, -3);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+}
+
+/**
+ * Return a new reference to the code object compiled from the string
+ * at 'src' with the given start token, going through the code cache.
+ */
+static PyObject *py_code_get(lua_State *L, int src, int mode)
+{
+	PyObject *code = NULL;
+	py_object *obj;
+	int cache;
+
+	py_code_cache(L, mode);
+	cache = lua_gettop(L);
+
+	lua_rawgeti(L, cache, 1);
+	lua_pushvalue(L, src);
+	lua_rawget(L, -2);
+	obj = check_py_object(L, -1);
+	if (!obj) {
+		lua_pop(L, 2);
+		lua_rawgeti(L, cache, 2);
+		lua_pushvalue(L, src);
+		lua_rawget(L, -2);
+		obj = check_py_object(L, -1);
+		if (obj) {
+			lua_pushvalue(L, -1);
+			py_code_cache_put(L, cache, src);
+		}
+	}
+	if (obj) {
+		code = obj->o;
+		Py_INCREF(code);
+		lua_settop(L, cache-1);
+		return code;
+	}
+	lua_settop(L, cache);
+
+	/* Statements need a trailing newline to compile. */
+	if (mode == Py_eval_input) {
+		lua_pushvalue(L, src);
+	} else {
+		lua_pushvalue(L, src);
+		lua_pushliteral(L, "\n");
+		lua_concat(L, 2);
+	}
+	code = Py_CompileString(lua_tostring(L, -1), "<lua>", mode);
+	lua_pop(L, 1);
+	if (code) {
+		py_convert_custom(L, code, 0);
+		py_code_cache_put(L, cache, src);
+	}
+	lua_settop(L, cache-1);
+	return code;
+}
+
+static PyObject *py_main_dict(lua_State *L)
+{
+	PyObject *m = PyImport_AddModule("__main__");
+	if (!m) {
+		luaL_error(L, "Can't get __main__ module");
+		return NULL;
+	}
+	return PyModule_GetDict(m);
+}
+
+static int py_run(lua_State *L, int eval)
+{
+	PyObject *code, *d, *o;
+	int ret = 0;
+
+	luaL_checkstring(L, 1);
+
+	d = py_main_dict(L);
+
+	code = py_code_get(L, 1, eval ? Py_eval_input : Py_single_input);
+	if (!code) {
+		py_error(L, "error compiling python code");
+		return 0;
+	}
+
+	o = PyEval_EvalCode((PyCodeObject *)code, d, d);
+	Py_DECREF(code);
+
+	if (!o) {
+		py_error(L, "error running python code");
+		return 0;
+	}
+
+	if (py_convert(L, o, 0))
+		ret = 1;
+
+	Py_DECREF(o);
+
+	if (Py_FlushLine())
+		PyErr_Clear();
+
+	return ret;
+}
+
+/* Build a new dict out of the Lua table at 'idx'. */
+static PyObject *py_dict_from_table(lua_State *L, int idx)
+{
+	PyObject *dict = PyDict_New();
+	if (!dict)
+		return NULL;
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		PyObject *key = LuaConvertPy(L, -2);
+		PyObject *value = LuaConvertPy(L, -1);
+		int rc = (key && value) ? PyDict_SetItem(dict, key, value) : -1;
+		Py_XDECREF(key);
+		Py_XDECREF(value);
+		lua_pop(L, 1);
+		if (rc == -1) {
+			lua_pop(L, 1);
+			Py_DECREF(dict);
+			return NULL;
+		}
+	}
+	return dict;
+}
+
+/**
+ * Call a compiled code object. Upvalues are the code and, optionally,
+ * its globals dict (the __main__ dict otherwise). An optional argument
+ * gives the locals, as a Lua table or a Python mapping.
+ */
+static int py_code_call(lua_State *L)
+{
+	py_object *code = check_py_object(L, lua_upvalueindex(1));
+	py_object *env = check_py_object(L, lua_upvalueindex(2));
+	PyObject *globals, *locals, *o;
+	int ret = 0;
+
+	globals = env ? env->o : py_main_dict(L);
+
+	if (lua_istable(L, 1)) {
+		locals = py_dict_from_table(L, 1);
+		if (!locals) {
+			py_error(L, "failed to convert locals");
+			return 0;
+		}
+	} else if (check_py_object(L, 1)) {
+		locals = check_py_object(L, 1)->o;
+		Py_INCREF(locals);
+	} else {
+		locals = globals;
+		Py_INCREF(locals);
+	}
+
+	o = PyEval_EvalCode((PyCodeObject *)code->o, globals, locals);
+	Py_DECREF(locals);
+
+	if (!o) {
+		py_error(L, "error running python code");
+		return 0;
+	}
+
+	ret = py_convert(L, o, 0);
+	Py_DECREF(o);
+
+	if (Py_FlushLine())
+		PyErr_Clear();
+
+	return ret;
+}
+
+/**
+ * python.compile(src [, mode [, env]]) - compile Python code once and
+ * return a Lua function running it. 'mode' is "exec" (default), "eval"
+ * or "single". 'env' is the globals dict to run in: a Python dict,
+ * true for a fresh namespace private to the returned function, or nil
+ * for the __main__ module. The function takes optional locals.
+ */
+static int py_compile(lua_State *L)
+{
+	static const char *const modes[] = {"exec", "eval", "single", NULL};
+	static const int starts[] = {Py_file_input, Py_eval_input, Py_single_input};
+	int mode;
+	PyObject *code;
+
+	luaL_checkstring(L, 1);
+	mode = starts[luaL_checkoption(L, 2, "exec", modes)];
+
+	code = py_code_get(L, 1, mode);
+	if (!code) {
+		py_error(L, "error compiling python code");
+		return 0;
+	}
+	py_convert_custom(L, code, 0);
+	Py_DECREF(code);
+
+	if (lua_isnoneornil(L, 3)) {
+		lua_pushnil(L);
+	} else if (lua_isboolean(L, 3) && lua_toboolean(L, 3)) {
+		PyObject *env = PyDict_New();
+		if (!env || PyDict_SetItemString(env, "__builtins__",
+						 PyEval_GetBuiltins()) == -1) {
+			Py_XDECREF(env);
+			py_error(L, "failed to create namespace");
+			return 0;
+		}
+		py_convert_custom(L, env, 1);
+		Py_DECREF(env);
+	} else {
+		py_object *env = check_py_object(L, 3);
+		if (!env || !PyDict_Check(env->o)) {
+			luaL_argerror(L, 3, "dict or true expected");
+			return 0;
+		}
+		/* Same as the exec statement does. */
+		if (!PyDict_GetItemString(env->o, "__builtins__") &&
+		    PyDict_SetItemString(env->o, "__builtins__",
+					 PyEval_GetBuiltins()) == -1) {
+			py_error(L, "failed to set namespace builtins");
+			return 0;
+		}
+		lua_pushvalue(L, 3);
+	}
+
+	lua_pushcclosure(L, py_code_call, 2);
+	return 1;
+}
+
+static int py_execute(lua_State *L)
+{
+	return py_run(L, 0);
+}
+
+static int py_eval(lua_State *L)
+{
+	return py_run(L, 1);
+}
+
+static int py_asindx(lua_State *L)
 {
 	py_object *obj = check_py_object(L, 1);
 	if (obj)
@@ -562,8 +2419,7 @@ static int py_globals(lua_State *L)
 	}
 
 	if (!globals) {
-		PyErr_Print();
-		luaL_error(L, "can't get globals");
+		py_error(L, "can't get globals");
 		return 0;
 	}
 
@@ -597,14 +2453,54 @@ static int py_builtins(lua_State *L)
 
 	builtins = PyEval_GetBuiltins();
 	if (!builtins) {
-		PyErr_Print();
-		luaL_error(L, "failed to get builtins");
+		py_error(L, "failed to get builtins");
 		return 0;
 	}
 
 	return py_convert_custom(L, builtins, 1);
 }
 
+#define PMODULES "PyModules"
+
+/* Push the per-state table of modules handed out by python.import */
+static void py_modules(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, PMODULES);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, PMODULES);
+	}
+}
+
+/* Give the module userdata at 'ud' an attribute cache and remember it
+ * as the module for 'name', unless one is known already. */
+static void py_module_setup(lua_State *L, int ud, const char *name)
+{
+	lua_createtable(L, 2, 1);
+	lua_pushlightuserdata(L, &py_module_cache_key);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	lua_newtable(L);
+	lua_rawseti(L, -2, 1);
+	lua_newtable(L);
+	lua_rawseti(L, -2, 2);
+	lua_setfenv(L, ud);
+
+	py_modules(L);
+	lua_getfield(L, -1, name);
+	if (lua_isnil(L, -1)) {
+		lua_pushvalue(L, ud);
+		lua_setfield(L, -3, name);
+	}
+	lua_pop(L, 2);
+}
+
+/**
+ * python.import(name) - import a module. Each state hands out a single
+ * userdata per module, so repeated imports are a table lookup.
+ */
 static int py_import(lua_State *L)
 {
 	const char *name = luaL_checkstring(L, 1);
@@ -616,80 +2512,506 @@ static int py_import(lua_State *L)
 		return 0;
 	}
 
+	py_modules(L);
+	lua_getfield(L, -1, name);
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 2);
+
 	module = PyImport_ImportModule((char*)name);
 
-	if (!module) {
-		PyErr_Print();
-		luaL_error(L, "failed importing '%s'", name);
-		return 0;
-	}
+	if (!module)
+		return py_import_error(L, name);
 
 	ret = py_convert_custom(L, module, 0);
 	Py_DECREF(module);
+	py_module_setup(L, lua_gettop(L), name);
 	return ret;
 }
 
+/**
+ * Import the module behind the lazy proxy at 'ud', turning the proxy
+ * into a regular python object in place. Returns NULL, with a Python
+ * error set if the import failed, when 'ud' is not a pending proxy.
+ */
+py_object *py_lazy_resolve(lua_State *L, int ud)
+{
+	py_object *obj = (py_object *) check_udata(L, ud, PLAZY);
+	const char *name;
+
+	if (!obj)
+		return NULL;
+	if (ud < 0 && ud > LUA_REGISTRYINDEX)
+		ud = lua_gettop(L) + ud + 1;
+
+	lua_getfenv(L, ud);
+	lua_rawgeti(L, -1, 1);
+	name = lua_tostring(L, -1);
+	obj->o = PyImport_ImportModule((char*)name);
+	if (!obj->o) {
+		lua_pop(L, 2);
+		return NULL;
+	}
+	luaL_getmetatable(L, POBJECT);
+	lua_setmetatable(L, ud);
+	py_module_setup(L, ud, name);
+	lua_pop(L, 2);
+	return obj;
+}
+
+static void py_lazy_check(lua_State *L)
+{
+	if (!py_lazy_resolve(L, 1))
+		py_lazy_error(L, 1);
+}
+
+static int py_lazy_index(lua_State *L)
+{
+	py_lazy_check(L);
+	return py_object_index(L);
+}
+
+static int py_lazy_newindex(lua_State *L)
+{
+	py_lazy_check(L);
+	return py_object_newindex(L);
+}
+
+static int py_lazy_call(lua_State *L)
+{
+	py_lazy_check(L);
+	return py_object_call(L);
+}
+
+static int py_lazy_tostring(lua_State *L)
+{
+	lua_getfenv(L, 1);
+	lua_rawgeti(L, -1, 1);
+	lua_pushfstring(L, "python lazy module '%s'", lua_tostring(L, -1));
+	return 1;
+}
+
+static const luaL_reg py_lazy_lib[] = {
+	{"__index",	py_lazy_index},
+	{"__newindex",	py_lazy_newindex},
+	{"__call",	py_lazy_call},
+	{"__tostring",	py_lazy_tostring},
+	{NULL, NULL}
+};
+
+/**
+ * python.lazyimport(name) - return a proxy for a module which is only
+ * imported when first used.
+ */
+static int py_lazyimport(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	py_object *obj;
+
+	py_modules(L);
+	lua_getfield(L, -1, name);
+	if (!lua_isnil(L, -1))
+		return 1;
+	lua_pop(L, 2);
+
+	obj = (py_object *) lua_newuserdata(L, sizeof(py_object));
+	obj->o = NULL;
+	obj->asindx = 0;
+	luaL_getmetatable(L, PLAZY);
+	lua_setmetatable(L, -2);
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+	return 1;
+}
+
+/**
+ * python.view(obj [, fmt]) - typed view over a Python buffer object.
+ * Items are read and written as Lua numbers straight from the object
+ * memory, indexed from 1 like a Lua array. 'fmt' is a single struct
+ * module type code and defaults to 'B'.
+ */
+static int py_view_new(lua_State *L)
+{
+	py_object *obj = check_py_object(L, 1);
+	const char *fmt = luaL_optstring(L, 2, "B");
+	Py_ssize_t itemsize;
+	py_view *v;
+
+	if (!obj) {
+		luaL_argerror(L, 1, "not a python object");
+		return 0;
+	}
+	if (fmt[0] == '@')
+		fmt++;
+	itemsize = py_view_itemsize(fmt[0]);
+	if (!itemsize || fmt[1] != '\0') {
+		luaL_argerror(L, 2, "unsupported format");
+		return 0;
+	}
+
+	v = (py_view *) lua_newuserdata(L, sizeof(py_view));
+	if (py_getbuffer(obj->o, &v->view, 1) == -1) {
+		py_error(L, "object does not support the buffer protocol");
+		return 0;
+	}
+	v->fmt = fmt[0];
+	v->itemsize = itemsize;
+	v->len = v->view.len / itemsize;
+	luaL_getmetatable(L, PVIEW);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/**
+ * python.strview(obj) - read-only string-like view over a Python buffer
+ * object, supporting len/sub/byte/find (plain) without copying the data
+ * into a Lua string. Lua strings are returned unchanged.
+ */
+static int py_strview_new(lua_State *L)
+{
+	py_object *obj;
+	py_view *v;
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		lua_settop(L, 1);
+		return 1;
+	}
+	obj = check_py_object(L, 1);
+	if (!obj) {
+		luaL_argerror(L, 1, "not a python object");
+		return 0;
+	}
+
+	v = (py_view *) lua_newuserdata(L, sizeof(py_view));
+	if (py_getbuffer(obj->o, &v->view, 0) == -1) {
+		py_error(L, "object does not support the buffer protocol");
+		return 0;
+	}
+	v->fmt = 'c';
+	v->itemsize = 1;
+	v->len = v->view.len;
+	luaL_getmetatable(L, PSTRVIEW);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+/* python.numarray(n, fmt='d') - new zeroed lua.NumArray */
+static int py_numarray_new(lua_State *L)
+{
+	lua_Integer n = luaL_checkinteger(L, 1);
+	const char *fmt = luaL_optstring(L, 2, "d");
+	PyObject *a;
+
+	if (fmt[0] == '\0' || fmt[1] != '\0' || !py_view_itemsize(fmt[0]))
+		return luaL_argerror(L, 2, "unsupported format");
+	a = LuaNumArray_New(n, fmt[0]);
+	if (!a)
+		return py_error(L, "failed to create numarray");
+	py_convert_numarray(L, a);
+	Py_DECREF(a);
+	return 1;
+}
+
+/**
+ * python.tostring(view) - copy the contents of a view into a real Lua
+ * string.
+ */
+static int py_tostring(lua_State *L)
+{
+	py_view *v;
+
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		lua_settop(L, 1);
+		return 1;
+	}
+	v = check_py_strview(L, 1);
+	if (!v)
+		v = check_py_view(L, 1);
+	if (!v) {
+		luaL_argerror(L, 1, "not a python view");
+		return 0;
+	}
+	if (py_buffer_refresh(&v->view) == -1)
+		return py_error(L, "failed to get python view buffer");
+	lua_pushlstring(L, (const char *)v->view.buf,
+			v->view.len / v->itemsize * v->itemsize);
+	return 1;
+}
+
 static const luaL_reg py_lib[] = {
 	{"execute",	py_execute},
 	{"eval",	py_eval},
+	{"compile",	py_compile},
 	{"asindx",	py_asindx},
 	{"asattr",	py_asattr},
 	{"asfunc",	py_asfunc},
 	{"locals",	py_locals},
 	{"globals",	py_globals},
 	{"builtins",	py_builtins},
+	{"iter",	py_iter},
+	{"items",	py_items},
+	{"fields",	py_fields},
+	{"snapshot",	py_snapshot},
 	{"import",	py_import},
+	{"lazyimport",	py_lazyimport},
+	{"view",	py_view_new},
+	{"strview",	py_strview_new},
+	{"numarray",	py_numarray_new},
+	{"struct",	py_struct_new},
+	{"tostring",	py_tostring},
+	{"freeze",	py_freeze},
 	{NULL, NULL}
 };
 
+/* Register python.none, in the module at 'module' and the registry */
+static void py_register_none(lua_State *L, int module)
+{
+	lua_pushliteral(L, "Py_None");
+	if (!py_convert_custom(L, Py_None, 0)) {
+		lua_pop(L, 1);
+		luaL_error(L, "failed to convert none object");
+	}
+	lua_pushvalue(L, -1);
+	lua_setfield(L, module, "none");
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * Initialization flag 'field' of the options table at 'opts' (0 for
+ * none), else from the environment variable 'env'.
+ */
+static int py_init_flag(lua_State *L, int opts, const char *field, const char *env)
+{
+	const char *s;
+	int flag;
+
+	if (opts) {
+		lua_getfield(L, opts, field);
+		if (!lua_isnil(L, -1)) {
+			flag = lua_toboolean(L, -1);
+			lua_pop(L, 1);
+			return flag;
+		}
+		lua_pop(L, 1);
+	}
+	s = getenv(env);
+	return s && *s && strcmp(s, "0") != 0;
+}
+
+/**
+ * Initialize the interpreter for a Lua host. Options, from the table
+ * at 'opts' or the environment: 'nosite' skips importing site,
+ * 'isolated' ignores PYTHON* variables and the user site directory and
+ * leaves sys.path[0] alone, 'home' sets the Python home and 'path' (a
+ * list of strings) replaces sys.path.
+ */
+static void py_initialize(lua_State *L, int opts)
+{
+	static char *argv[] = {"<lua>", 0};
+	PyObject *luam, *mainm, *maind;
+	int isolated;
+
+	if (Py_IsInitialized())
+		return;
+
+	if (py_init_flag(L, opts, "nosite", "LUNATIC_PYTHON_NOSITE"))
+		Py_NoSiteFlag = 1;
+	isolated = py_init_flag(L, opts, "isolated", "LUNATIC_PYTHON_ISOLATED");
+	if (isolated) {
+		Py_IgnoreEnvironmentFlag = 1;
+		Py_NoUserSiteDirectory = 1;
+	}
+	if (opts) {
+		lua_getfield(L, opts, "home");
+		/* Python keeps the pointer */
+		if (lua_isstring(L, -1))
+			Py_SetPythonHome(strdup(lua_tostring(L, -1)));
+		lua_pop(L, 1);
+
+		/* Checked before there is a Python side to clean up */
+		lua_getfield(L, opts, "path");
+		if (!lua_isnil(L, -1)) {
+			int i, n;
+			if (!lua_istable(L, -1))
+				luaL_error(L, "python option 'path' must be a list of strings");
+			n = lua_objlen(L, -1);
+			for (i = 1; i <= n; i++) {
+				lua_rawgeti(L, -1, i);
+				if (lua_type(L, -1) != LUA_TSTRING)
+					luaL_error(L, "python option 'path' entry %d is not a string", i);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	Py_SetProgramName("<lua>");
+	Py_Initialize();
+	PySys_SetArgvEx(1, argv, !isolated);
+
+	if (opts) {
+		lua_getfield(L, opts, "path");
+		if (lua_istable(L, -1)) {
+			int i, n = lua_objlen(L, -1);
+			PyObject *path = PyList_New(n), *item;
+			const char *s;
+			size_t len;
+			for (i = 0; path && i != n; i++) {
+				lua_rawgeti(L, -1, i+1);
+				s = lua_tolstring(L, -1, &len);
+				item = PyString_FromStringAndSize(s, len);
+				lua_pop(L, 1);
+				if (!item)
+					Py_CLEAR(path);
+				else
+					PyList_SET_ITEM(path, i, item);
+			}
+			if (!path || PySys_SetObject("path", path) == -1) {
+				Py_XDECREF(path);
+				py_error(L, "failed setting sys.path");
+			}
+			Py_DECREF(path);
+		}
+		lua_pop(L, 1);
+	}
+
+	initlua();
+	/* Import 'lua' automatically. */
+	luam = PyImport_ImportModule("lua");
+	if (!luam) {
+		luaL_error(L, "Can't import lua module");
+	} else {
+		mainm = PyImport_AddModule("__main__");
+		if (!mainm) {
+			luaL_error(L, "Can't get __main__ module");
+		} else {
+			maind = PyModule_GetDict(mainm);
+			PyDict_SetItemString(maind, "lua", luam);
+			Py_DECREF(luam);
+		}
+	}
+}
+
+/* Fill in the python module at 'module', initializing Python first. */
+static void py_open(lua_State *L, int module, int opts)
+{
+	py_initialize(L, opts);
+
+	/* States created from Lua have no Python side yet. */
+	lua_getglobal(L, "_PyLuaState");
+	if (lua_isnil(L, -1)) {
+		lua_pushlightuserdata(L, LuaState_borrow(L));
+		lua_setglobal(L, "_PyLuaState");
+	}
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, module);
+	luaL_register(L, NULL, py_lib);
+	lua_pop(L, 1);
+	py_register_none(L, module);
+}
+
+/**
+ * __index of the python module while initialization is deferred: the
+ * first python.* lookup initializes Python with the options kept in
+ * the registry and fills in the module.
+ */
+static int py_deferred_open(lua_State *L)
+{
+	lua_settop(L, 2);
+	lua_getfield(L, LUA_REGISTRYINDEX, PINITOPTS);
+	py_open(L, 1, lua_istable(L, 3) ? 3 : 0);
+	lua_pushnil(L);
+	lua_setmetatable(L, 1);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, PINITOPTS);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 1);
+	return 1;
+}
+
+/**
+ * Open the python module. When loaded directly with an options table
+ * as argument (see py_initialize), or with LUNATIC_PYTHON_LAZY set,
+ * option 'lazy' defers initializing Python until python.* is used.
+ */
 LUA_API int luaopen_python(lua_State *L)
 {
-	int rc;
+	static const luaL_reg none[] = {{NULL, NULL}};
+	int opts = lua_istable(L, 1) ? 1 : 0;
+	int module;
 
 	/* Register module */
-	luaL_register(L, "python", py_lib);
+	luaL_register(L, "python", none);
+	module = lua_gettop(L);
 
 	/* Register python object metatable */
 	luaL_newmetatable(L, POBJECT);
 	luaL_register(L, NULL, py_object_lib);
 	lua_pop(L, 1);
 
-	/* Initialize Python interpreter */
-	if (!Py_IsInitialized()) {
-		PyObject *luam, *mainm, *maind;
-		char *argv[] = {"<lua>", 0};
-		Py_SetProgramName("<lua>");
-		Py_Initialize();
-		PySys_SetArgv(1, argv);
-		initlua();
-		/* Import 'lua' automatically. */
-		luam = PyImport_ImportModule("lua");
-		if (!luam) {
-			luaL_error(L, "Can't import lua module");
-		} else {
-			mainm = PyImport_AddModule("__main__");
-			if (!mainm) {
-				luaL_error(L, "Can't get __main__ module");
-			} else {
-				maind = PyModule_GetDict(mainm);
-				PyDict_SetItemString(maind, "lua", luam);
-				Py_DECREF(luam);
-			}
-		}
-	}
+	/* Register lazy module proxy metatable */
+	luaL_newmetatable(L, PLAZY);
+	luaL_register(L, NULL, py_lazy_lib);
+	lua_pop(L, 1);
 
-	/* Register 'none' */
-	lua_pushliteral(L, "Py_None");
-	rc = py_convert_custom(L, Py_None, 0);
-	if (rc) {
-		lua_pushliteral(L, "none"); /* M "Py_None" None "none" */
-		lua_pushvalue(L, -2);	    /* M "Py_None" None "none" None */
-		lua_rawset(L, -5); /* python.none */
-		lua_rawset(L, LUA_REGISTRYINDEX); /* registry.Py_None */
+	/* Register python buffer view metatable */
+	luaL_newmetatable(L, PVIEW);
+	luaL_register(L, NULL, py_view_lib);
+	lua_pop(L, 1);
+
+	/* Register python string view metatable */
+	luaL_newmetatable(L, PSTRVIEW);
+	luaL_register(L, NULL, py_strview_lib);
+	lua_newtable(L);
+	luaL_register(L, NULL, py_strview_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* Register python exception metatable */
+	luaL_newmetatable(L, PEXC);
+	luaL_register(L, NULL, py_exception_lib);
+	lua_pop(L, 1);
+
+	/* Register ctypes structure metatable */
+	luaL_newmetatable(L, PSTRUCT);
+	luaL_register(L, NULL, py_struct_lib);
+	lua_pop(L, 1);
+
+	/* Register numeric array metatable */
+	luaL_newmetatable(L, PNUMARRAY);
+	luaL_register(L, NULL, py_numarray_lib);
+	lua_pop(L, 1);
+
+	/* Register frozen table metatable */
+	luaL_newmetatable(L, PFROZEN);
+	luaL_register(L, NULL, py_frozen_lib);
+	lua_pop(L, 1);
+
+	/* Register output sink metatable */
+	luaL_newmetatable(L, PSINK);
+	luaL_register(L, NULL, py_sink_lib);
+	lua_newtable(L);
+	luaL_register(L, NULL, py_sink_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	if (!Py_IsInitialized() &&
+	    py_init_flag(L, opts, "lazy", "LUNATIC_PYTHON_LAZY")) {
+		if (opts) {
+			lua_pushvalue(L, opts);
+			lua_setfield(L, LUA_REGISTRYINDEX, PINITOPTS);
+		}
+		lua_createtable(L, 0, 1);
+		lua_pushcfunction(L, py_deferred_open);
+		lua_setfield(L, -2, "__index");
+		lua_setmetatable(L, module);
 	} else {
-		lua_pop(L, 1);
-		luaL_error(L, "failed to convert none object");
+		py_open(L, module, opts);
 	}
 
+	lua_settop(L, module);
 	return 1;
 }
@@ -24,8 +24,20 @@
 #define PYTHONINLUA_H
 
 #define POBJECT "PyObject"
+#define PVIEW "PyView"
+#define PSTRVIEW "PyStrView"
+#define PSINK "PySink"
+#define PLAZY "PyLazyModule"
+#define PSNAPSHOTS "PySnapshots"
+#define PEXC "PyException"
+#define PINITOPTS "PyInitOptions"
+#define PFROZEN "PyFrozenTable"
+#define PNUMARRAY "PyNumArray"
+#define PSTRUCT "PyStruct"
+#define PSTRUCTS "PyStructLayouts"
 
 int py_convert(lua_State *L, PyObject *o, int withnone);
+int py_converter_register(PyTypeObject *type, LuaFromPyFunc fn);
 
 typedef struct {
 	PyObject *o;
@@ -36,6 +48,53 @@ void stackDump(lua_State *L);
 void tableDump(lua_State *L, int t);
 
 py_object *check_py_object(lua_State *L, int ud);
+py_object *py_lazy_resolve(lua_State *L, int ud);
+void py_snapshot_invalidate(lua_State *L, PyObject *o);
+
+/* Typed view over the memory of a Python buffer object */
+typedef struct {
+	Py_buffer view;
+	char fmt;
+	Py_ssize_t itemsize;
+	Py_ssize_t len;
+} py_view;
+
+py_view *check_py_view(lua_State *L, int ud);
+py_view *check_py_strview(lua_State *L, int ud);
+PyObject *check_py_sink(lua_State *L, int ud);
+PyObject *check_py_numarray(lua_State *L, int ud);
+
+/* Field access to a ctypes structure through its buffer; the layout
+ * table of its type is its environment */
+typedef struct {
+	Py_buffer view;
+} py_struct;
+
+py_struct *check_py_struct(lua_State *L, int ud);
+int py_getbuffer(PyObject *o, Py_buffer *view, int writable);
+int py_buffer_refresh(Py_buffer *view);
+Py_ssize_t py_view_itemsize(char fmt);
+void py_view_push(lua_State *L, char fmt, const char *p);
+int py_view_store(char fmt, char *p, lua_Number n);
+
+/* Python exception raised into Lua, kept unformatted. Its environment
+ * holds the 'where' message at [1]. */
+typedef struct {
+	PyObject *type;
+	PyObject *value;
+	PyObject *tb;
+} py_exception;
+
+/* Read-only proxy of a frozen table, whose contents are its environment.
+ * 'frozen' is the Python mapping built from it, if one is alive. */
+typedef struct {
+	PyObject *frozen;
+} py_frozen;
+
+int py_freeze(lua_State *L);
+
+int py_error(lua_State *L, const char *where);
+int py_exception_restore(lua_State *L, int n);
 
 LUA_API int luaopen_python(lua_State *L);
 
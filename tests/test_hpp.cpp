@@ -0,0 +1,123 @@
+/*
+ * Tests for src/lunaticpython.hpp. Built by "waf build" as test_hpp,
+ * linking the bridge sources, and run by "waf check".
+ */
+#include "lunaticpython.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" void initlua(void);
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		exit(1);						\
+	}								\
+} while (0)
+
+static void test_call(const lunatic::State &state)
+{
+	using lunatic::call;
+
+	CHECK(call<double(double, double)>(state, "math.max", 1, 2.5) == 2.5);
+	CHECK(call<int(const char *)>(state, "string.len", "abcd") == 4);
+	CHECK(call<std::string(std::string, int)>(state, "string.rep",
+						  std::string("ab"), 3) == "ababab");
+	CHECK(call<bool(int, int)>(state, "rawequal", 1, 1));
+	call<void(std::string_view, int)>(state, "rawset_global", "x", 42);
+	CHECK(call<int(const char *)>(state, "rawget_global", "x") == 42);
+}
+
+static void test_objects(const lunatic::State &state)
+{
+	using lunatic::call;
+	using lunatic::Object;
+	using lunatic::Ref;
+
+	Object o = Object::steal(PyInt_FromLong(41));
+	CHECK(call<std::string(Object)>(state, "tostring", std::move(o)) == "41");
+
+	Ref r = call<Ref(int)>(state, "pair", 7);
+	Object t = r.get();
+	CHECK(PyObject_TypeCheck(t.get(), &LuaObjectType));
+	Object back = call<Object(Ref)>(state, "unpack", std::move(r));
+	CHECK(PyInt_Check(back.get()) && PyInt_AsLong(back.get()) == 7);
+}
+
+static int convert_complex(lua_State *L, PyObject *o)
+{
+	PyErr_SetString(PyExc_ValueError, "no complex numbers in lua");
+	return -1;
+}
+
+static void test_errors(const lunatic::State &state)
+{
+	using lunatic::call;
+	using lunatic::Object;
+	int top = lua_gettop(state.L());
+	bool thrown = false;
+
+	try {
+		call<void()>(state, "boom");
+	} catch (lunatic::PythonError &) {
+		CHECK(false);
+	} catch (lunatic::Error &e) {
+		thrown = std::string(e.what()).find("bad") != std::string::npos;
+	}
+	CHECK(thrown);
+
+	thrown = false;
+	try {
+		call<void()>(state, "pyboom");
+	} catch (lunatic::PythonError &) {
+		thrown = PyErr_ExceptionMatches(PyExc_ZeroDivisionError);
+		PyErr_Clear();
+	}
+	CHECK(thrown);
+
+	thrown = false;
+	try {
+		call<int()>(state, "nothing");
+	} catch (lunatic::Error &) {
+		thrown = true;
+	}
+	CHECK(thrown);
+
+	thrown = false;
+	try {
+		Object c = Object::steal(PyComplex_FromDoubles(1, 2));
+		call<void(Object)>(state, "tostring", std::move(c));
+	} catch (lunatic::PythonError &) {
+		thrown = PyErr_ExceptionMatches(PyExc_ValueError);
+		PyErr_Clear();
+	}
+	CHECK(thrown);
+	CHECK(lua_gettop(state.L()) == top);
+}
+
+int main()
+{
+	Py_Initialize();
+	initlua();
+	{
+		lunatic::Lock lock;
+		lunatic::State state;
+
+		CHECK(luaL_dostring(state.L(),
+			"function rawset_global(k, v) rawset(_G, k, v) end\n"
+			"function rawget_global(k) return rawget(_G, k) end\n"
+			"function pair(x) return {x, x} end\n"
+			"function boom() error('bad') end\n"
+			"function pyboom() python.eval('1/0') end\n") == 0);
+		test_call(state);
+		test_objects(state);
+		CHECK(py_converter_register(&PyComplex_Type, convert_complex) == 0);
+		test_errors(state);
+		CHECK(lunatic::State::global().object() == GetGlobalLuaState());
+	}
+	Py_Finalize();
+	printf("HPP TESTS OK\n");
+	return 0;
+}
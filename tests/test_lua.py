@@ -55,6 +55,663 @@ key is 'a' and value is 1
 key is 'c' and value is 3
 key is 'b' and value is 2
 
+# Buffer views
+
+>>> import array
+>>> lg.ba = bytearray('abc')
+>>> lua.eval("(function() local v = python.view(ba); v[1] = v[3]; return #v end)()")
+3
+>>> lg.ba
+bytearray(b'cbc')
+>>> lua.execute("v = python.view(ba) v[1] = 255 v[2] = -0.5")
+>>> list(lg.ba)
+[255, 0, 99]
+>>> lua.execute("v[1] = 256")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: value out of range for python view format 'B'
+>>> lua.execute("python.view(python.eval('bytearray(4)'), 'i')[1] = 0/0")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: value out of range for python view format 'i'
+>>> lg.arr = array.array('d', [0.5, 1.5, 2.5])
+>>> lua.execute("v = python.view(arr, 'd'); for i = 1, #v do v[i] = v[i] * 2 end")
+>>> lg.arr
+array('d', [1.0, 3.0, 5.0])
+>>> lua.eval("v[4]")
+>>> lua.eval("v") is lg.arr
+True
+>>> lg.arr.extend([7.0] * 1000); lua.eval("#v"), lua.eval("v[1003]")
+(1003, 7)
+>>> del lg.arr[:]; lua.eval("#v"), lua.eval("v[1]")
+(0, None)
+>>> lua.execute("v = python.view(python.eval([[buffer('abc')]]))")
+>>> lua.eval("v[2]")
+98
+>>> lua.execute("v[2] = 1")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: python view is read-only
+
+>>> lg.body = memoryview('GET /index.html HTTP/1.1')
+>>> lua.execute("s = python.strview(body)")
+>>> lua.eval("#s"), lua.eval("s:len()")
+(24, 24)
+>>> lua.eval("s:sub(5, s:find(' ', 5) - 1)")
+'/index.html'
+>>> lua.eval("s:sub(-3)"), lua.eval("s:byte(1)"), lua.eval("select(2, s:find('HTTP'))")
+('1.1', 71, 20)
+>>> lua.eval("s:find('%s')")
+>>> lua.eval("python.tostring(s)")
+'GET /index.html HTTP/1.1'
+>>> lua.eval("python.strview('plain')")
+'plain'
+>>> lg.chars = array.array('c', 'hello')
+>>> lua.execute("cs = python.strview(chars)")
+>>> lg.chars.extend('!' * 1000); lua.eval("cs:sub(1, 6)"), lua.eval("#cs")
+('hello!', 1005)
+>>> del lg.chars[:]; lua.eval("cs:sub(1)"), lua.eval("cs:find('h')"), lua.eval("#cs")
+('', None, 0)
+
+# Chunk loading
+
+>>> import os, tempfile, StringIO
+>>> fd, path = tempfile.mkstemp(suffix='.lua')
+>>> os.write(fd, '#!/usr/bin/lua\\nlocal n = ...\\nreturn (n or 20) + 1\\n')
+50
+>>> os.close(fd)
+>>> lua.execute_file(path)
+21
+>>> chunk = lua.load_file(path)
+>>> chunk
+<Lua function at 0x...>
+>>> chunk(1)
+2
+>>> os.unlink(path)
+>>> lua.load_file(path)
+Traceback (most recent call last):
+...
+IOError: [Errno 2] No such file or directory: '...'
+>>> f = StringIO.StringIO('return ' + ' + '.join(['1'] * 1000))
+>>> chunk = lua.load_stream(f, '=gen', 7)
+>>> chunk()
+1000
+>>> lua.load_stream(StringIO.StringIO('return +'))
+Traceback (most recent call last):
+...
+RuntimeError: error loading code: <stream>:1: unexpected symbol near '+'
+
+# Output capture
+
+>>> out = lua.capture()
+>>> render = lua.eval("function(out, items) for i, v in ipairs(items) do out:write('<li>', v, '</li>') end out:write(#items) return out end")
+>>> render(out, lua.eval("{'a', 'b'}")) is out
+True
+>>> out.getvalue()
+'<li>a</li><li>b</li>2'
+>>> len(out), lua.eval("function(o) return #o end")(out)
+(21, 21)
+>>> m = memoryview(out)
+>>> m.tobytes()
+'<li>a</li><li>b</li>2'
+>>> out.write('x' * 1000)
+Traceback (most recent call last):
+...
+BufferError: sink is exported, can't grow it
+>>> del m
+>>> out.clear()
+>>> out.getvalue()
+''
+
+# Compiled Python code
+
+>>> lua.execute("for i = 1, 200 do python.execute('counter = ' .. (i % 3)) end")
+>>> __main__.counter
+2
+>>> lua.execute("for i = 1, 200 do python.eval('counter + ' .. (i % 70)) end")
+>>> lua.execute("scale = python.compile('x * factor', 'eval', python.eval([[{'factor': 3}]]))")
+>>> lua.eval("scale{x = 5}"), lua.eval("scale(python.eval([[{'x': 2}]]))")
+(15, 6)
+>>> lua.execute("bump = python.compile([[n = n + 1 if 'n' in globals() else 1]], 'exec', true)")
+>>> lua.execute("bump() bump() bump()")
+>>> 'n' in vars(__main__)
+False
+>>> ns = {}
+>>> lg.ns = ns
+>>> lua.execute("inc = python.compile([[n = n + 1 if 'n' in globals() else 1]], 'exec', ns) inc() inc()")
+>>> ns['n']
+2
+>>> lua.execute("python.compile('1 +', 'eval')")
+Traceback (most recent call last):
+...
+SyntaxError: unexpected EOF while parsing
+
+# Module imports
+
+>>> lua.eval("python.import('string') == python.import('string')")
+True
+>>> lua.eval("python.import('string').upper('abc')")
+'ABC'
+>>> import string
+>>> lua.execute("s = python.import('string') f1 = s.upper f2 = s.upper")
+>>> lua.eval("f1 == f2")
+True
+>>> string.upper = string.lower
+>>> lua.eval("s.upper('ABC')")
+'abc'
+>>> reload(string) and None
+>>> lua.execute("lazy = python.lazyimport('colorsys')")
+>>> 'colorsys' in sys.modules
+False
+>>> lua.eval("tostring(lazy)")
+"python lazy module 'colorsys'"
+>>> lua.eval("lazy.rgb_to_hsv(1, 0, 0)")
+(0.0, 1, 1)
+>>> 'colorsys' in sys.modules, lua.eval("lazy == python.import('colorsys')")
+(True, True)
+>>> lua.eval("python.lazyimport('colorsys')") is sys.modules['colorsys']
+True
+>>> lua.execute("local m = python.lazyimport('no_such_module').x")
+Traceback (most recent call last):
+...
+ImportError: No module named no_such_module
+>>> lua.eval("select(2, pcall(python.import, 'no_such_module')).where")
+"failed importing 'no_such_module'"
+>>> lua.eval("tostring(select(2, pcall(function() return python.lazyimport('no_such_module').x end)))")
+"failed importing 'no_such_module': ImportError: No module named no_such_module"
+
+# Exceptions
+
+>>> def fail(): raise KeyError('boom')
+>>> lg.fail = fail
+>>> lua.execute("fail()")
+Traceback (most recent call last):
+...
+KeyError: 'boom'
+>>> lua.eval("select(2, pcall(fail)).type") is KeyError
+True
+>>> lua.eval("tostring(select(2, pcall(fail)))")
+"error calling python function: KeyError: 'boom'"
+>>> 'in fail' in lua.eval("select(2, pcall(fail)).traceback")
+True
+>>> try:
+...     lua.eval("function() local ok, e = pcall(fail) error(e) end")()
+... except KeyError, e:
+...     e.args
+('boom',)
+>>> lua.execute("error({code = 42})")
+Traceback (most recent call last):
+...
+LuaError: <Lua table at 0x...>
+>>> try:
+...     lua.execute("error({code = 42})")
+... except lua.LuaError, e:
+...     e.args[0].code
+42
+>>> def rethrow(): lua.execute("error(t)")
+>>> lg.t, lg.rethrow = lua.eval("{}"), rethrow
+>>> lua.eval("select(2, pcall(rethrow)) == t")
+True
+
+# Iteration
+
+>>> collect = lua.eval("function(f) local t = {} for a, b in f do t[#t+1] = tostring(a) .. (b ~= nil and '=' .. tostring(b) or '') end return table.concat(t, ',') end")
+>>> lg.seq = ['a', None, 'c']
+>>> collect(lua.eval("python.iter(seq)"))
+'a,None,c'
+>>> collect(lua.eval("python.items(seq)"))
+'0=a,1,2=c'
+>>> lg.dd = {'k': 1}
+>>> collect(lua.eval("python.items(dd)"))
+'k=1'
+>>> lg.gen = (x * x for x in range(4))
+>>> collect(lua.eval("python.iter(gen)"))
+'0,1,4,9'
+>>> lua.execute("for k in python.iter(dd) do dd.x = 1 end")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: dictionary changed size during iteration
+
+# Snapshots
+
+>>> lg.cfg = {'mode': 'fast', 'limits': [1, 2]}
+>>> lua.execute("snap = python.snapshot(cfg)")
+>>> lua.eval("snap.mode"), lua.eval("rawequal(snap, python.snapshot(cfg))")
+('fast', True)
+>>> lua.execute("snap.mode = 'lua'")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: attempt to modify a frozen table
+>>> lg.cfg['mode'] = 'slow'
+>>> lua.eval("python.snapshot(cfg).mode")
+'fast'
+>>> lua.invalidate(lg.cfg)
+>>> lua.eval("python.snapshot(cfg).mode")
+'slow'
+>>> lg.cfg['extra'] = 1
+>>> lua.eval("python.snapshot(cfg).extra")
+1
+>>> lua.execute("cfg.mode = 'lua'")
+>>> lua.eval("python.snapshot(cfg).mode")
+'lua'
+>>> lua.eval("python.snapshot(cfg, true).limits[2]")
+2
+>>> lua.execute("python.snapshot(cfg, true).limits[1] = 0")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: attempt to modify a frozen table
+>>> lua.eval("#python.snapshot(python.eval('(1, 2, 3)'))")
+3
+>>> import weakref
+>>> class Config(dict): pass
+>>> c = Config(mode='fast'); ref = weakref.ref(c)
+>>> lua.eval("function(c) return python.snapshot(c).mode end")(c)
+'fast'
+>>> del c; ref() is None
+False
+>>> lua.execute("for i = 1, 200 do python.snapshot(python.eval('[]')) end collectgarbage()")
+>>> ref() is None
+True
+
+# String conversion
+
+>>> keys = [k for k in lua.eval("{name = 1}")] + [k for k in lua.eval("{name = 2}")]
+>>> keys, keys[0] is keys[1]
+(['name', 'name'], True)
+>>> t = lua.eval("{}")
+>>> for i in range(3):
+...     t.field = i
+...     lua.execute("collectgarbage()")
+>>> t.field, lua.eval("function(t) return t.field end")(t)
+(2, 2)
+>>> lua.execute("s = string.rep('x', 100)")
+>>> lua.eval("s") == 'x' * 100
+True
+
+# Converters
+
+>>> lua.eval("1.5"), lua.eval("-2")
+(1.5, -2)
+>>> class Str(str): pass
+>>> lua.eval("function(s) return type(s) end")(Str('x'))
+'string'
+>>> type(lua._converters).__name__, type(lua._C_API).__name__
+('PyCapsule', 'PyCapsule')
+>>> import ctypes
+>>> from ctypes import c_int, c_double, c_char_p, c_void_p, py_object
+>>> ctypes.pythonapi.PyCapsule_GetPointer.restype = c_void_p
+>>> ctypes.pythonapi.PyCapsule_GetPointer.argtypes = [py_object, c_char_p]
+>>> FromPy = ctypes.CFUNCTYPE(c_int, c_void_p, py_object)
+>>> ToPy = ctypes.CFUNCTYPE(py_object, c_void_p, c_int)
+>>> class Converters(ctypes.Structure):
+...     _fields_ = [('version', c_int),
+...                 ('from_py', ctypes.PYFUNCTYPE(c_int, py_object, FromPy)),
+...                 ('to_py', ctypes.PYFUNCTYPE(c_int, c_char_p, ToPy))]
+>>> conv = Converters.from_address(ctypes.pythonapi.PyCapsule_GetPointer(
+...     lua._converters, "lua._converters"))
+>>> liblua = ctypes.CDLL(lua.__file__)
+>>> for name, res, args in [('lua_createtable', None, [c_int, c_int]),
+...                         ('lua_pushnumber', None, [c_double]),
+...                         ('lua_tonumber', c_double, [c_int]),
+...                         ('lua_setfield', None, [c_int, c_char_p]),
+...                         ('lua_getfield', None, [c_int, c_char_p]),
+...                         ('luaL_newmetatable', c_int, [c_char_p]),
+...                         ('lua_setmetatable', c_int, [c_int]),
+...                         ('lua_settop', None, [c_int])]:
+...     f = getattr(liblua, name)
+...     f.restype, f.argtypes = res, [c_void_p] + args
+>>> class Point(object):
+...     def __init__(self, x): self.x = x
+>>> tname = "test.Point"
+>>> @FromPy
+... def point_to_lua(L, o):
+...     liblua.lua_createtable(L, 0, 1)
+...     liblua.lua_pushnumber(L, o.x)
+...     liblua.lua_setfield(L, -2, "x")
+...     liblua.luaL_newmetatable(L, tname)
+...     liblua.lua_setmetatable(L, -2)
+...     return 1
+>>> @ToPy
+... def point_from_lua(L, n):
+...     liblua.lua_getfield(L, n, "x")
+...     x = liblua.lua_tonumber(L, -1)
+...     liblua.lua_settop(L, -2)
+...     return Point(x)
+>>> conv.version, conv.from_py(Point, point_to_lua), conv.to_py(tname, point_from_lua)
+(1, 0, 0)
+>>> lua.eval("function(p) return type(p), p.x end")(Point(1.5))
+('table', 1.5)
+>>> p = lua.eval("function(p) p.x = p.x * 2; return p end")(Point(1.5))
+>>> type(p).__name__, p.x
+('Point', 3.0)
+>>> conv.from_py(Point, FromPy()), conv.to_py(tname, ToPy())
+(0, 0)
+>>> lua.eval("function(p) return type(p) end")(Point(1.5))
+'userdata'
+>>> class CAPI(ctypes.Structure):
+...     _fields_ = [('version', c_int),
+...                 ('get_state', ctypes.PYFUNCTYPE(c_void_p, py_object)),
+...                 ('global_state', ctypes.PYFUNCTYPE(c_void_p)),
+...                 ('to_py', ctypes.PYFUNCTYPE(py_object, py_object, c_int)),
+...                 ('wrap', ctypes.PYFUNCTYPE(py_object, py_object, c_int)),
+...                 ('push', ctypes.PYFUNCTYPE(c_int, py_object, py_object))]
+>>> capi = CAPI.from_address(ctypes.pythonapi.PyCapsule_GetPointer(
+...     lua._C_API, "lua._C_API"))
+>>> liblua.lua_gettop.restype, liblua.lua_gettop.argtypes = c_int, [c_void_p]
+>>> state = lua.new_state()
+>>> L = capi.get_state(state)
+>>> capi.version, capi.global_state() != 0, liblua.lua_gettop(L)
+(1, True, 0)
+>>> capi.get_state(42)
+Traceback (most recent call last):
+...
+TypeError: LuaState expected
+>>> capi.push(state, 'abc'), capi.push(state, [1, 2]), liblua.lua_gettop(L)
+(1, 1, 2)
+>>> capi.to_py(state, 1), capi.to_py(state, -1)
+('abc', [1, 2])
+>>> capi.wrap(state, 1)
+<Lua string>
+>>> liblua.lua_settop(L, 0)
+
+# Table construction
+
+>>> t = lua.new_table(init=['a', 'b', 'c'])
+>>> lua.eval("function(t) return #t, t[3] end")(t)
+(3, 'c')
+>>> t = lua.new_table(init={'x': 1, 2: 'y'})
+>>> t.x, t[2]
+(1, 'y')
+>>> t = lua.new_table(100, 10)
+>>> t.field = 1
+>>> lua.eval("function(t) return #t, t.field end")(t)
+(0, 1)
+>>> lua.new_table(init={None: 1})
+Traceback (most recent call last):
+...
+ValueError: invalid table key
+>>> import collections
+>>> class Items(collections.Mapping):
+...     def __init__(self, items): self._items = items
+...     def __getitem__(self, k): return dict(self._items)[k]
+...     def __iter__(self): return iter(dict(self._items))
+...     def __len__(self): return len(self._items)
+...     def items(self): return iter(self._items)
+>>> lua.new_table(init=Items([('a', 1)])).a
+1
+>>> lua.new_table(init=Items([('a', 1, 2)]))
+Traceback (most recent call last):
+...
+TypeError: items() must return (key, value) pairs
+
+# Batched field access
+
+>>> t = lua.eval("{a = 1, b = 'x', getmany = 5}")
+>>> lua.getmany(t, ['a', 'b', 'getmany', 'missing'])
+(1, 'x', 5, None)
+>>> t.getmany, t.next, t.__len__
+(5, None, None)
+>>> class Rec: pass
+>>> r = Rec()
+>>> r.x, r.y = 1, 'two'
+>>> lg.r, lg.rd = r, {'k': 3}
+>>> lua.getmany(lua.eval("{python.fields(r, 'x', 'y')}"), [1, 2])
+(1, 'two')
+>>> lua.eval("select('#', python.fields(rd, 'k', 'missing'))"), lua.eval("python.fields(rd, 'k')")
+(2, 3)
+
+# Sessions
+
+>>> lua.execute("cfg = {db = {host = 'h', port = 5}} function pair(a, b) return {a, b}, a + b end")
+>>> with lua.session() as s:
+...     g = s.globals()
+...     db = s.get(s.get(g, 'cfg'), 'db')
+...     s.set(db, 'port', 6)
+...     t, n = s.call(s.get(g, 'pair'), 1, 2)
+...     lg.kept = t
+...     kept = s.value(t)
+...     s.get(db, 'host'), s.get(db, 'port'), n
+('h', 6, 3)
+>>> lua.eval("cfg.db.port"), lua.eval("kept[2]"), kept[1]
+(6, 2, 1)
+>>> s.get(db, 'host')
+Traceback (most recent call last):
+...
+RuntimeError: session is not active
+>>> lua.execute("cfg2 = {a = 1, b = {2}}")
+>>> s1, s2 = lua.session(), lua.session()
+>>> _ = s1.__enter__(); _ = s2.__enter__()
+>>> a = s2.get(s2.globals(), 'cfg2')
+>>> s1.__exit__(None, None, None)
+False
+>>> s3 = lua.session().__enter__()
+>>> b = s3.get(s3.get(s3.globals(), 'cfg2'), 'b')
+>>> a
+<Lua slot (released) at 0x...>
+>>> s2.get(a, 'a')
+Traceback (most recent call last):
+...
+RuntimeError: session is not active
+>>> s2.__exit__(None, None, None), s3.get(b, 1)
+(False, 2)
+>>> s3.__exit__(None, None, None)
+False
+
+# Record types
+
+>>> Row = lua.record_type(['id', 'score', 'tags'])
+>>> Row.fields
+('id', 'score', 'tags')
+>>> row = lua.eval("{id = 7, score = 1.5}")
+>>> Row.get(row)
+(7, 1.5, None)
+>>> Row.set(row, (8, 2.5, 'x'))
+>>> Row.get(row)
+(8, 2.5, 'x')
+>>> p = Row.wrap(row)
+>>> p.score += 1
+>>> p.score, row.score
+(3.5, 3.5)
+>>> p.other = 1
+Traceback (most recent call last):
+...
+AttributeError: other
+>>> Row.set(row, (1, 2))
+Traceback (most recent call last):
+...
+ValueError: expected 3 values
+>>> Pair = state.record_type(['a', 'b'])
+>>> Pair.wrap(5)
+Traceback (most recent call last):
+...
+TypeError: Lua object is not a table
+>>> liblua.lua_gettop(L)
+0
+
+# Frozen tables
+
+>>> cfg = lua.freeze(lua.eval("{db = {host = 'h', ports = {80, 443}}, debug = false}"))
+>>> cfg['db']['host'], cfg.db.ports[2], cfg['debug'], 'db' in cfg, len(cfg)
+('h', 443, False, True, 2)
+>>> lg.cfg = cfg
+>>> lua.eval("cfg.db") is cfg.db, lua.eval("#cfg.db.ports")
+(True, 2)
+>>> lua.execute("cfg.db.host = 'x'")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: attempt to modify a frozen table
+>>> cfg['debug'] = True
+Traceback (most recent call last):
+...
+TypeError: 'lua.LuaFrozen' object does not support item assignment
+>>> lua.execute("n = 0 for k, v in cfg.db.ports() do n = n + v end")
+>>> lg.n, sorted(cfg.db.keys())
+(523, ['host', 'ports'])
+>>> f = lua.freeze(lua.eval("{get = 2, keys = 3, x = 1}"))
+>>> f.get('get'), f['keys'], f.x, sorted(f.keys())
+(2, 3, 1, ['get', 'keys', 'x'])
+>>> f.y
+Traceback (most recent call last):
+...
+AttributeError: 'lua.LuaFrozen' object has no attribute 'y'
+
+# Incremental sync
+
+>>> lua.execute("function dump(t) local s = {} for k, v in pairs(t) do s[#s+1] = k .. '=' .. tostring(v) end table.sort(s) return table.concat(s, ' ') end")
+>>> dump = lg.dump
+>>> mirror = lua.eval("{stale = 1}")
+>>> d = {'a': 1, 'b': 'x'}
+>>> lua.sync(mirror, d)
+>>> dump(mirror)
+'a=1 b=x'
+>>> d['a'] = 2; del d['b']; d['c'] = 3
+>>> lua.sync(mirror, d)
+>>> dump(mirror)
+'a=2 c=3'
+>>> lua.execute("function touch(t) t.a = 10 t.c = nil t.z = true end")
+>>> lg.touch(mirror)
+>>> d['e'] = 5
+>>> sorted(lua.sync(mirror, d, journal=True).items())
+[('a', 10), ('c', None), ('z', True)]
+>>> dump(mirror), lua.sync(mirror, d, journal=True)
+('a=10 e=5 z=true', {})
+>>> lua.sync(mirror, {(1, 2): 'x'})
+Traceback (most recent call last):
+...
+TypeError: can't sync key of type 'tuple'
+>>> lua.sync(mirror, {u'a': 1})
+Traceback (most recent call last):
+...
+TypeError: can't sync key of type 'unicode'
+>>> nums = lua.eval("{}")
+>>> lua.sync(nums, {1: 'a', 2.5: 'b'}); lua.sync(nums, {1: 'c'}); dump(nums)
+'1=c'
+>>> dump(mirror)
+'a=10 e=5 z=true'
+
+# Column expressions
+
+>>> from array import array
+>>> a, b = array('d', [1, 2, 3]), array('i', [10, 20, 30])
+>>> out = array('d', [0] * 3)
+>>> lua.eval_columns("a*2 + b", columns={'a': a, 'b': b}, out=out) is out
+True
+>>> out.tolist()
+[12.0, 24.0, 36.0]
+>>> lua.eval_columns("math.max(a, 2)", {'a': a}, out).tolist()
+[2.0, 2.0, 3.0]
+>>> lua.eval_columns("a", {'a': array('d', [1])}, out)
+Traceback (most recent call last):
+...
+ValueError: a: expected 3 items
+>>> lua.eval_columns("a > 1", {'a': a}, out)
+Traceback (most recent call last):
+...
+RuntimeError: error evaluating columns: row 1: expression result is not a number
+>>> lua.eval_columns("a * 2", {'a': bytearray('\x01\x02\x03')}, out).tolist()
+[2.0, 4.0, 6.0]
+>>> import mmap
+>>> lua.eval_columns("a", {'a': mmap.mmap(-1, 20)}, array('d', [0, 0]))
+Traceback (most recent call last):
+...
+ValueError: a: size is not a multiple of 8 bytes
+>>> lg.grow = lambda: a.extend([0] * 1000) or 0
+>>> lua.eval_columns("a + grow()", {'a': a}, out).tolist(), len(a)
+([1.0, 2.0, 3.0], 3003)
+>>> a = array('d', [1, 2, 3])
+>>> lg.shrink = lambda: a.pop() and 0
+>>> lua.eval_columns("a + shrink()", {'a': a}, out)
+Traceback (most recent call last):
+...
+RuntimeError: error evaluating columns: row 1: buffer was resized
+>>> lua.eval_columns("a * 100", {'a': array('d', [1, 2])}, array('b', [0, 0]))
+Traceback (most recent call last):
+...
+RuntimeError: error evaluating columns: row 2: result out of range for out
+
+# Numeric arrays
+
+>>> arr = lua.NumArray(3)
+>>> arr
+<NumArray 'd' [3] at 0x...>
+>>> lg.arr = arr
+>>> lua.execute("for i = 1, #arr do arr[i] = i / 2 end")
+>>> arr.tolist(), lua.eval("arr") is arr
+([0.5, 1.0, 1.5], True)
+>>> arr[0] = 4
+>>> lua.eval("arr[1] + arr[3]"), memoryview(arr).format, len(memoryview(arr).tobytes())
+(5.5, 'd', 24)
+>>> lua.eval_columns("a + 1", {'a': arr}, arr).tolist()
+[5.0, 2.0, 2.5]
+>>> lua.eval("python.numarray(2, 'i')").typecode
+'i'
+>>> b = lua.NumArray(2, 'B')
+>>> b[0] = 255; b[1] = 0
+>>> b[1] = 300
+Traceback (most recent call last):
+...
+OverflowError: value out of range for NumArray format 'B'
+>>> b[1] = -1
+Traceback (most recent call last):
+...
+OverflowError: value out of range for NumArray format 'B'
+>>> u = lua.NumArray(1, 'I')
+>>> u[0] = 2**32 - 1; u[0]
+4294967295L
+>>> u[0] = 2**32
+Traceback (most recent call last):
+...
+OverflowError: value out of range for NumArray format 'I'
+>>> b[1] = 1.5
+Traceback (most recent call last):
+...
+TypeError: 'float' object cannot be interpreted as an index
+>>> b.tolist()
+[255, 0]
+>>> lua.execute("arr[4] = 1")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: python numarray index out of range
+>>> lua.execute("python.numarray(1, 'b')[1] = -129")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: value out of range for python numarray format 'b'
+
+# ctypes structures
+
+>>> import ctypes
+>>> class Point(ctypes.Structure):
+...     _fields_ = [('x', ctypes.c_int), ('y', ctypes.c_double), ('name', ctypes.c_char * 4)]
+...     def norm(self): return abs(self.x) + abs(self.y)
+...     @property
+...     def double(self): return self.x * 2
+>>> pt = Point(1, 2.5, 'ab')
+>>> lg.pt = pt
+>>> lua.execute("s = python.struct(pt) s.x = s.x + 41 s.y = s.y * 2")
+>>> pt.x, pt.y, lua.eval("s.name"), lua.eval("s.double"), lua.eval("s.norm()")
+(42, 5.0, 'ab', 84, 47)
+>>> lua.eval("s") is pt
+True
+>>> lua.eval("s.missing")
+Traceback (most recent call last):
+...
+AttributeError: 'Point' object has no attribute 'missing'
+>>> lua.execute("s.missing = 1")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: python struct has no field 'missing'
+>>> lua.execute("s.x = 2^31")
+Traceback (most recent call last):
+...
+RuntimeError: error executing code: [string "<python>"]:1: value out of range for field 'x'
+>>> import gc
+>>> T = type('T', (ctypes.Structure,), {'_fields_': [('v', ctypes.c_int)]})
+>>> tref = weakref.ref(T)
+>>> lua.eval("function(o) return python.struct(o).v end")(T(5))
+5
+>>> del T; lua.execute("collectgarbage()"); _ = gc.collect(); tref() is None
+True
+
 # Multiple state tests
 
 >>> state1 = lua.new_state()
@@ -69,6 +726,28 @@ key is 'b' and value is 2
 666
 >>> state3.globals()['x']
 [1, 2, 3]
+>>> state4 = lua.new_state(libs=['string', 'math'], lazy=True)
+>>> state4.eval("rawget(_G, 'math')") is None
+True
+>>> state4.eval("math.floor(2.5)"), state4.eval("('abc'):upper()")
+(2, 'ABC')
+>>> state4.eval("rawget(_G, 'math') ~= nil"), state4.eval("io")
+(True, None)
+>>> state4.eval("getmetatable(_G)") is None
+True
+>>> state6 = lua.new_state(libs=['math', 'os'], lazy=True)
+>>> state6.execute("mt = {__index = getmetatable(_G).__index} setmetatable(_G, mt)")
+>>> state6.eval("os.time() > 0 and math.pi > 3"), state6.eval("getmetatable(_G) == mt")
+(True, True)
+>>> lua.new_state(libs=[], lazy=True).eval("getmetatable(_G)") is None
+True
+>>> state5 = lua.new_state(libs=['table'], python_bridge=False)
+>>> state5.eval("table.concat({1, 2})"), state5.eval("string"), state5.eval("python")
+('12', None, None)
+>>> lua.new_state(libs=['nope'])
+Traceback (most recent call last):
+...
+ValueError: unknown library 'nope'
 
 """
 
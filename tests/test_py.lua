@@ -13,3 +13,66 @@ pg.d = d
 -- This crashes if you've compiled the python.so to include another
 -- Lua interpreter, i.e., with -llua.
 python.execute("d['key'] = 'value'")
+assert('value' == d.key)
+
+assert("userdata" == type(python.none))
+assert(python.eval("lua.eval('1 + 2')") == 3)
+
+orig = {a = {1, 2}}
+frozen = python.freeze(orig)
+assert(frozen.a[2] == 2 and #frozen.a == 2)
+assert(not pcall(function() frozen.b = 1 end))
+orig.b = 1
+assert(frozen.b == nil and type(frozen) == "userdata")
+assert(not pcall(pairs, frozen))
+pg.frozen = frozen
+assert(python.eval("frozen['a'][1]") == 1)
+assert(python.eval("frozen") == frozen)
+
+nums = python.numarray(4)
+nums[2] = 1.5
+pg.nums = nums
+assert(python.eval("nums[1]") == 1.5 and #nums == 4)
+
+-- Initialization options, each checked in a fresh interpreter
+prefix = python.eval("__import__('sys').prefix")
+function run(env, opts, code)
+	local name = os.tmpname()
+	local f = io.open(name, "w")
+	f:write([[
+for p in package.cpath:gmatch("[^;]+") do
+	open = open or package.loadlib((p:gsub("%?", "python")), "luaopen_python")
+end
+python = open(]], opts, ")\n", code, "\nio.write('ok')\n")
+	f:close()
+	os.execute(env .. " " .. (arg[-1] or "lua") .. " " .. name .. " >" .. name .. ".out 2>&1")
+	f = io.open(name .. ".out")
+	local out = f:read("*a")
+	f:close()
+	os.remove(name)
+	os.remove(name .. ".out")
+	assert(out == "ok", out)
+end
+lazy = [[
+assert(rawget(python, "eval") == nil and getmetatable(python))
+assert(python.eval("1 + 1") == 2 and rawget(python, "eval"))
+]]
+run("", "{lazy = true}", lazy)
+run("LUNATIC_PYTHON_LAZY=1", "", lazy)
+run("", "{}", [[assert(python.eval("'site' in __import__('sys').modules"))]])
+run("", "{nosite = true}", [[assert(python.eval("'site' not in __import__('sys').modules"))]])
+run("LUNATIC_PYTHON_NOSITE=1", "", [[assert(python.eval("'site' not in __import__('sys').modules"))]])
+run("", string.format("{isolated = true, home = %q}", prefix), [[
+sys = python.import("sys")
+assert(sys.flags.ignore_environment == 1 and sys.flags.no_user_site == 1)
+assert(sys.path[0] ~= "")
+]])
+run("", string.format("{home = %q}", prefix),
+    string.format("assert(python.eval(\"__import__('sys').prefix\") == %q)", prefix))
+run("", "{path = {'/nonexistent', 'lib'}}",
+    [[assert(python.eval("__import__('sys').path == ['/nonexistent', 'lib']"))]])
+run("", [[(function()
+	local ok, err = pcall(open, {path = {'lib', 1}})
+	assert(not ok and err:find("entry 2 is not a string"), err)
+	return {path = {'lib'}}
+end)()]], [[assert(python.eval("__import__('sys').path == ['lib']"))]])